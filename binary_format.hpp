@@ -0,0 +1,201 @@
+/**
+ * @file binary_format.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Compact binary encoding of log records, written by the file sink in
+ *        binary mode and expanded back to text by logdecode.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * A binary log is a sequence of sessions. Each session starts with a header
+ * and is followed by entries, each introduced by a tag byte:
+ *
+ *   header:         "LOGB" version:u8 base_time:varint
+ *   function_name:  tag id:varint length:varint bytes
+ *   format_string:  tag id:varint length:varint bytes
+ *   record:         tag time_delta:zigzag-varint level:u8 function_id:varint
+ *                   format_id:varint args_length:varint args
+ *
+ * Names and format strings are interned: they are defined once per session,
+ * before the first record that uses them. Format id 0 means a plain message,
+ * whose args are a single packed string. Args use the log_args packing.
+ * Times are nanoseconds since the Unix epoch, each record stores the signed
+ * difference to the previous one.
+ */
+
+
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "log_args.hpp"
+
+namespace binary_format {
+
+constexpr char magic[4] = {'L', 'O', 'G', 'B'};
+constexpr uint8_t version = 1;
+
+/* enum class tag: first byte of every entry after the session header */
+enum class tag: uint8_t
+{
+    function_name = 1,
+    format_string = 2,
+    record = 3
+};
+
+inline void put_varint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/**
+ * @brief Reads a varint.
+ * @return false if the input ends before the varint does.
+ */
+inline bool get_varint(const char*& p, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/**
+ * @brief Encoder state of one binary log session.
+ *
+ * Not thread-safe: the logger only encodes from its writer thread. Interning
+ * allocates when a name or format string is seen for the first time.
+ */
+class encoder
+{
+private:
+    bool started = false;
+    uint64_t last_time = 0;
+    std::deque<std::string> names;                                  // owns the keys of function_ids
+    std::unordered_map<std::string_view, uint32_t> function_ids;
+    std::unordered_map<const void*, uint32_t> site_ids;             // call sites whose name is known
+    std::unordered_map<const char*, uint32_t> format_ids;
+
+    static void put_definition(std::string& out, tag kind, uint32_t id, std::string_view text)
+    {
+        out += static_cast<char>(kind);
+        put_varint(out, id);
+        put_varint(out, text.size());
+        out.append(text.data(), text.size());
+    }
+
+    uint32_t function_id(std::string& out, std::string_view name, const void* site)
+    {
+        if (site)
+        {
+            // Static call site descriptors never move, so their address stands for the name
+            auto known = site_ids.find(site);
+            if (known != site_ids.end())
+                return known->second;
+        }
+
+        uint32_t id;
+        auto it = function_ids.find(name);
+        if (it != function_ids.end())
+        {
+            id = it->second;
+        }
+        else
+        {
+            id = static_cast<uint32_t>(function_ids.size());
+            names.emplace_back(name);
+            function_ids.emplace(names.back(), id);
+            put_definition(out, tag::function_name, id, name);
+        }
+
+        if (site)
+            site_ids.emplace(site, id);
+        return id;
+    }
+
+    uint32_t format_id(std::string& out, const char* format)
+    {
+        if (!format)
+            return 0;
+        auto it = format_ids.find(format);
+        if (it != format_ids.end())
+            return it->second;
+
+        uint32_t id = static_cast<uint32_t>(format_ids.size()) + 1;
+        format_ids.emplace(format, id);
+        put_definition(out, tag::format_string, id, format);
+        return id;
+    }
+
+public:
+    /**
+     * @brief Appends a record, preceded by the session header and any definitions it needs.
+     * @param out The encoded bytes are appended here.
+     * @param time The time of the record, in ns since epoch.
+     * @param level The log level as a number.
+     * @param fun_name The function name.
+     * @param format The format string of a deferred record, nullptr for a plain message.
+     * @param payload The packed arguments, or the message text of a plain record.
+     * @param site The static call site descriptor of the record if it has one, looked up by address.
+     */
+    void encode(std::string& out, uint64_t time, uint8_t level, std::string_view fun_name,
+                const char* format, std::string_view payload, const void* site = nullptr)
+    {
+        if (!started)
+        {
+            out.append(magic, sizeof(magic));
+            out += static_cast<char>(version);
+            put_varint(out, time);
+            last_time = time;
+            started = true;
+        }
+
+        uint32_t fun = function_id(out, fun_name, site);
+        uint32_t fmt = format_id(out, format);
+
+        out += static_cast<char>(tag::record);
+        put_varint(out, zigzag(static_cast<int64_t>(time - last_time)));
+        last_time = time;
+        out += static_cast<char>(level);
+        put_varint(out, fun);
+        put_varint(out, fmt);
+        if (format)
+        {
+            put_varint(out, payload.size());
+            out.append(payload.data(), payload.size());
+        }
+        else
+        {
+            size_t size = log_args::packed_size(payload);
+            put_varint(out, size);
+            size_t pos = out.size();
+            out.resize(pos + size);
+            log_args::pack(&out[pos], payload);
+        }
+    }
+};
+
+} // namespace binary_format
@@ -0,0 +1,122 @@
+/**
+ * @file epoch.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Epoch based reclamation used to swap objects that other threads are
+ *        still reading without putting a lock on the read side.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+/**
+ * @brief A minimal RCU style epoch domain.
+ *
+ * Readers wrap their accesses in an epoch::guard, which only touches a record
+ * owned by the calling thread. A writer publishes the new object, calls
+ * synchronize() and can then free the old object: synchronize() returns once
+ * every reader that could still see the old pointer has left its guard.
+ * Both sides must access the shared pointer with seq_cst operations.
+ */
+class epoch
+{
+private:
+    struct alignas(64) reader
+    {
+        std::atomic<uint64_t> active{0};   // epoch the reader entered in, 0 when outside
+        std::atomic<bool> in_use{true};
+        reader* next = nullptr;
+    };
+
+    static std::atomic<uint64_t>& global()
+    {
+        static std::atomic<uint64_t> value{1};
+        return value;
+    }
+
+    static std::atomic<reader*>& readers()
+    {
+        static std::atomic<reader*> head{nullptr};
+        return head;
+    }
+
+    /**
+     * @brief Claims a free reader record or appends a new one. Records are never
+     *        freed, a thread that exits hands its record to the next new thread.
+     */
+    static reader* acquire_reader()
+    {
+        for (reader* r = readers().load(std::memory_order_acquire); r; r = r->next)
+        {
+            bool expected = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return r;
+        }
+
+        reader* r = new reader;
+        r->next = readers().load(std::memory_order_relaxed);
+        while (!readers().compare_exchange_weak(r->next, r, std::memory_order_release,
+                                                std::memory_order_relaxed))
+            ;
+        return r;
+    }
+
+    struct thread_reader
+    {
+        reader* record = acquire_reader();
+        ~thread_reader() { record->in_use.store(false, std::memory_order_release); }
+    };
+
+    static reader* local()
+    {
+        static thread_local thread_reader r;
+        return r.record;
+    }
+
+public:
+    /**
+     * @brief Marks the calling thread as reading for the lifetime of the guard.
+     *        Guards must not be nested.
+     */
+    class guard
+    {
+    private:
+        reader* r;
+
+    public:
+        guard() : r(local())
+        {
+            r->active.store(global().load(std::memory_order_acquire), std::memory_order_seq_cst);
+        }
+        ~guard() { r->active.store(0, std::memory_order_release); }
+
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+    };
+
+    /**
+     * @brief Waits until no reader is left that entered before this call.
+     */
+    static void synchronize()
+    {
+        uint64_t target = global().fetch_add(1, std::memory_order_seq_cst) + 1;
+        for (reader* r = readers().load(std::memory_order_acquire); r; r = r->next)
+        {
+            for (;;)
+            {
+                uint64_t e = r->active.load(std::memory_order_seq_cst);
+                if (e == 0 || e >= target)
+                    break;
+                std::this_thread::yield();
+            }
+        }
+    }
+};
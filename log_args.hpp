@@ -0,0 +1,167 @@
+/**
+ * @file log_args.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Packs the arguments of a deferred "fmt {} {}" log call into a compact
+ *        binary blob, so the text can be rendered later on the writer thread.
+ *        Named fields made with kv() are packed the same way, behind their key.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace log_args {
+
+/* enum class arg_type: tag byte written in front of every packed argument */
+enum class arg_type: uint8_t
+{
+    i64,            // any signed integer, 8 bytes
+    u64,            // any unsigned integer, 8 bytes
+    f64,            // float or double, 8 bytes
+    boolean,        // 1 byte
+    character,      // 1 byte
+    string,         // uint32_t length followed by the bytes, copied at the call site
+    pointer,        // 8 bytes, rendered as hex
+    key             // uint32_t length and the bytes of a field name, the field's value follows
+};
+
+/* A named field of a structured log call, see kv() */
+template <typename T>
+struct field
+{
+    std::string_view key;
+    const T& value;
+};
+
+/**
+ * @brief Names a log argument, e.g. add_log(level, fun, "login", kv("user", id), kv("ms", t)).
+ *
+ * Fields don't fill {} placeholders. They follow the message, as " user=42 ms=3" in text lines
+ * and as their own members in JSON and logfmt lines, see logging::line_format. They must come
+ * after the arguments of the placeholders.
+ */
+template <typename T>
+field<T> kv(std::string_view key, const T& value)
+{
+    return field<T>{key, value};
+}
+
+template <typename T>
+struct is_field : std::false_type {};
+template <typename T>
+struct is_field<field<T>> : std::true_type {};
+
+template <typename T>
+using bare = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template <typename T>
+constexpr bool is_string = std::is_same_v<std::decay_t<T>, const char*> ||
+                           std::is_same_v<std::decay_t<T>, char*> ||
+                           std::is_same_v<bare<T>, std::string> ||
+                           std::is_same_v<bare<T>, std::string_view>;
+
+/**
+ * @brief Number of bytes the packed argument takes, tag included.
+ */
+template <typename T>
+size_t packed_size(const T& value)
+{
+    if constexpr (is_field<T>::value)
+        return 1 + sizeof(uint32_t) + value.key.size() + packed_size(value.value);
+    else if constexpr (is_string<T>)
+        return 1 + sizeof(uint32_t) + std::string_view(value).size();
+    else if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, char>)
+        return 2;
+    else
+    {
+        static_assert(std::is_arithmetic_v<T> || std::is_pointer_v<T> || std::is_enum_v<T>,
+                      "deferred log arguments must be numbers, pointers, enums or strings");
+        return 1 + sizeof(uint64_t);
+    }
+}
+
+/**
+ * @brief Writes one packed argument.
+ * @return The first byte after it.
+ */
+template <typename T>
+char* pack(char* out, const T& value)
+{
+    auto put = [&out](arg_type type, const void* data, size_t size)
+    {
+        *out++ = static_cast<char>(type);
+        std::memcpy(out, data, size);
+        out += size;
+    };
+
+    if constexpr (is_field<T>::value)
+    {
+        uint32_t length = static_cast<uint32_t>(value.key.size());
+        put(arg_type::key, &length, sizeof(length));
+        std::memcpy(out, value.key.data(), value.key.size());
+        out += value.key.size();
+        return pack(out, value.value);
+    }
+    else if constexpr (is_string<T>)
+    {
+        std::string_view text(value);
+        uint32_t length = static_cast<uint32_t>(text.size());
+        put(arg_type::string, &length, sizeof(length));
+        std::memcpy(out, text.data(), text.size());
+        out += text.size();
+    }
+    else if constexpr (std::is_same_v<T, bool>)
+        put(arg_type::boolean, &value, 1);
+    else if constexpr (std::is_same_v<T, char>)
+        put(arg_type::character, &value, 1);
+    else if constexpr (std::is_floating_point_v<T>)
+    {
+        double v = static_cast<double>(value);
+        put(arg_type::f64, &v, sizeof(v));
+    }
+    else if constexpr (std::is_pointer_v<T>)
+    {
+        uint64_t v = reinterpret_cast<uintptr_t>(value);
+        put(arg_type::pointer, &v, sizeof(v));
+    }
+    else if constexpr (std::is_enum_v<T>)
+    {
+        int64_t v = static_cast<int64_t>(value);
+        put(arg_type::i64, &v, sizeof(v));
+    }
+    else if constexpr (std::is_signed_v<T>)
+    {
+        int64_t v = value;
+        put(arg_type::i64, &v, sizeof(v));
+    }
+    else
+    {
+        uint64_t v = value;
+        put(arg_type::u64, &v, sizeof(v));
+    }
+    return out;
+}
+
+template <typename... Args>
+size_t packed_size_all(const Args&... args)
+{
+    return (size_t{0} + ... + packed_size(args));
+}
+
+template <typename... Args>
+void pack_all(char* out, const Args&... args)
+{
+    ((out = pack(out, args)), ...);
+}
+
+} // namespace log_args
@@ -0,0 +1,863 @@
+/**
+ * @file log_format.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Text rendering of log lines. Kept apart from logging.cpp so tools such as
+ *        logdecode can produce the same lines without the global logger.
+ * @version 0.1
+ * @date 2024-11-30
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#include "logging.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#if (defined(__x86_64__) || defined(__SSE2__)) && !defined(LOGGING_NO_SIMD)
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(LOGGING_NO_SIMD)
+#include <arm_neon.h>
+#endif
+
+
+namespace {
+
+/* A fixed size buffer with the part of the std::string interface render uses. Text beyond its capacity is cut */
+struct fixed_text
+{
+    char* data;
+    size_t capacity;
+    size_t size;
+
+    void append(const char* text, size_t length)
+    {
+        length = std::min(length, capacity - size);
+        std::memcpy(data + size, text, length);
+        size += length;
+    }
+    void operator+=(char c) { append(&c, 1); }
+    void operator+=(const char* text) { append(text, std::strlen(text)); }
+};
+
+
+/* Level names of JSON and logfmt lines, indexed by log_level */
+constexpr const char* level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR", "FATAL", "UNKNOWN"};
+
+
+/* Bytes a JSON string must escape: the control characters, the quote and the backslash, and the
+   bytes outside ASCII, which escape checks for valid UTF-8 */
+bool json_special(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+}
+
+/* Bytes sanitizeText looks at: the control characters but the tab, DEL and everything outside ASCII */
+bool unsafe_byte(unsigned char c)
+{
+    return (c < 0x20 && c != '\t') || c >= 0x7f;
+}
+
+
+/*
+ * Scanners for the first byte that needs escaping or sanitizing. Each returns its index, or the
+ * length if there is none. The vector versions test 16 or 32 bytes at a time and are picked once
+ * at run time, see active_scanners. The scalar versions test 8 bytes at a time in a uint64_t and
+ * are used for the tails and on other CPUs.
+ */
+using scan_function = size_t (*)(const char* text, size_t length);
+
+constexpr uint64_t ones = 0x0101010101010101ull;
+constexpr uint64_t highs = 0x8080808080808080ull;
+
+size_t find_json_scalar(const char* text, size_t length, size_t i = 0)
+{
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, text + i, sizeof(word));
+        uint64_t quote = word ^ (ones * '"');
+        uint64_t backslash = word ^ (ones * '\\');
+        // A high bit is set for a byte from 0x80 up, below 0x20 or equal to '"' or '\' (and maybe bytes after it)
+        uint64_t found = word | ((word - ones * 0x20) & ~word) | ((quote - ones) & ~quote) |
+                         ((backslash - ones) & ~backslash);
+        if(found & highs)
+            break;
+    }
+    while(i < length && !json_special(static_cast<unsigned char>(text[i])))
+        ++i;
+    return i;
+}
+
+size_t find_unsafe_scalar(const char* text, size_t length, size_t i = 0)
+{
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, text + i, sizeof(word));
+        uint64_t del = word ^ (ones * 0x7f);
+        // Bytes from 0x80 up, below 0x20 (the tab too, sorted out below) or DEL
+        uint64_t found = word | ((word - ones * 0x20) & ~word) | ((del - ones) & ~del);
+        if(found & highs)
+            break;
+    }
+    while(i < length && !unsafe_byte(static_cast<unsigned char>(text[i])))
+        ++i;
+    return i;
+}
+
+#if (defined(__x86_64__) || defined(__SSE2__)) && !defined(LOGGING_NO_SIMD)
+#define LOGGING_SIMD_X86 1
+
+size_t find_json_sse2(const char* text, size_t length)
+{
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, control), v),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        // The high bits of the bytes themselves mark the ones from 0x80 up
+        if(int mask = _mm_movemask_epi8(found) | _mm_movemask_epi8(v))
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+    }
+    return find_json_scalar(text, length, i);
+}
+
+size_t find_unsafe_sse2(const char* text, size_t length)
+{
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        // A signed compare catches the bytes below 0x20 and the ones from 0x80 up at once
+        __m128i found = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab),
+                                         _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)));
+        if(int mask = _mm_movemask_epi8(found))
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+    }
+    return find_unsafe_scalar(text, length, i);
+}
+
+__attribute__((target("avx2")))
+size_t find_json_avx2(const char* text, size_t length)
+{
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                        _mm256_cmpeq_epi8(v, backslash)));
+        if(int mask = _mm256_movemask_epi8(found) | _mm256_movemask_epi8(v))
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+    }
+    return find_json_scalar(text, length, i);
+}
+
+__attribute__((target("avx2")))
+size_t find_unsafe_avx2(const char* text, size_t length)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i found = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab),
+                                            _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                                            _mm256_cmpeq_epi8(v, del)));
+        if(int mask = _mm256_movemask_epi8(found))
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+    }
+    return find_unsafe_scalar(text, length, i);
+}
+
+#elif defined(__aarch64__) && !defined(LOGGING_NO_SIMD)
+#define LOGGING_SIMD_NEON 1
+
+/* Index of the first set lane of a comparison result, 16 if there is none */
+size_t first_lane(uint8x16_t found)
+{
+    // Narrowing by 4 bits leaves a nibble per lane in a uint64_t
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+    return bits ? static_cast<size_t>(__builtin_ctzll(bits)) / 4 : 16;
+}
+
+size_t find_json_neon(const char* text, size_t length)
+{
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(text + i));
+        uint8x16_t found = vorrq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgeq_u8(v, vdupq_n_u8(0x80))),
+                                    vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))));
+        size_t lane = first_lane(found);
+        if(lane < 16)
+            return i + lane;
+    }
+    return find_json_scalar(text, length, i);
+}
+
+size_t find_unsafe_neon(const char* text, size_t length)
+{
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(text + i));
+        uint8x16_t found = vbicq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgeq_u8(v, vdupq_n_u8(0x7f))),
+                                    vceqq_u8(v, vdupq_n_u8('\t')));
+        size_t lane = first_lane(found);
+        if(lane < 16)
+            return i + lane;
+    }
+    return find_unsafe_scalar(text, length, i);
+}
+#else
+
+size_t find_json_portable(const char* text, size_t length) { return find_json_scalar(text, length); }
+size_t find_unsafe_portable(const char* text, size_t length) { return find_unsafe_scalar(text, length); }
+#endif
+
+struct scanners
+{
+    scan_function json;
+    scan_function unsafe;
+    const char* name;
+};
+
+/**
+ * @brief Picks the widest scanners the CPU supports, once.
+ */
+const scanners& active_scanners()
+{
+    static const scanners chosen = []() -> scanners
+    {
+#if defined(LOGGING_SIMD_X86)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return {find_json_avx2, find_unsafe_avx2, "avx2"};
+        return {find_json_sse2, find_unsafe_sse2, "sse2"};
+#elif defined(LOGGING_SIMD_NEON)
+        return {find_json_neon, find_unsafe_neon, "neon"};
+#else
+        return {find_json_portable, find_unsafe_portable, "scalar"};
+#endif
+    }();
+    return chosen;
+}
+
+size_t find_json_special(const char* text, size_t length)
+{
+    return active_scanners().json(text, length);
+}
+
+
+/**
+ * @brief Length of the valid UTF-8 sequence at text, 0 if it is not one.
+ * @details Overlong forms, surrogates and code points above U+10FFFF are not valid.
+ */
+size_t utf8_sequence(const unsigned char* text, size_t length)
+{
+    unsigned char lead = text[0];
+    size_t size;
+    unsigned char low = 0x80, high = 0xbf;      // range of the second byte
+    if(lead >= 0xc2 && lead <= 0xdf)
+        size = 2;
+    else if(lead >= 0xe0 && lead <= 0xef)
+    {
+        size = 3;
+        if(lead == 0xe0) low = 0xa0;
+        if(lead == 0xed) high = 0x9f;
+    }
+    else if(lead >= 0xf0 && lead <= 0xf4)
+    {
+        size = 4;
+        if(lead == 0xf0) low = 0x90;
+        if(lead == 0xf4) high = 0x8f;
+    }
+    else
+        return 0;
+
+    if(size > length || text[1] < low || text[1] > high)
+        return 0;
+    for(size_t i = 2; i < size; ++i)
+        if((text[i] & 0xc0) != 0x80)
+            return 0;
+    return size;
+}
+
+
+/**
+ * @brief Appends text escaped for a JSON string or a quoted logfmt value. Runs without special
+ *        bytes are copied as a whole.
+ * @details Valid UTF-8 is kept, every byte that is not part of a valid sequence becomes \ufffd,
+ *          so the line stays valid JSON whatever the message holds.
+ */
+template <typename Out>
+void escape(Out& out, const char* text, size_t length)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+    while(length)
+    {
+        size_t run = find_json_special(text, length);
+        out.append(text, run);
+        if(run == length)
+            return;
+
+        unsigned char c = static_cast<unsigned char>(text[run]);
+        if(c >= 0x80)
+        {
+            size_t size = utf8_sequence(reinterpret_cast<const unsigned char*>(text + run), length - run);
+            if(size)
+                out.append(text + run, size);
+            else
+                out.append("\\ufffd", 6);
+            size = size ? size : 1;
+            text += run + size;
+            length -= run + size;
+            continue;
+        }
+
+        char escaped[6] = {'\\', static_cast<char>(c), 0, 0, 0, 0};
+        size_t size = 2;
+        switch (c)
+        {
+            case '"': case '\\':                    break;
+            case '\n': escaped[1] = 'n';            break;
+            case '\r': escaped[1] = 'r';            break;
+            case '\t': escaped[1] = 't';            break;
+            case '\b': escaped[1] = 'b';            break;
+            case '\f': escaped[1] = 'f';            break;
+            default:
+                std::memcpy(escaped + 1, "u00", 3);
+                escaped[4] = hex[c >> 4];
+                escaped[5] = hex[c & 0xf];
+                size = 6;
+                break;
+        }
+        out.append(escaped, size);
+        text += run + 1;
+        length -= run + 1;
+    }
+}
+
+
+/* Wraps an output so that everything rendered into it is escaped, see escape */
+template <typename Out>
+struct escaped_text
+{
+    Out& out;
+
+    void append(const char* text, size_t length) { escape(out, text, length); }
+    void operator+=(char c) { append(&c, 1); }
+    void operator+=(const char* text) { append(text, std::strlen(text)); }
+};
+
+
+log_args::arg_type type_of(const char* arg)
+{
+    return static_cast<log_args::arg_type>(*arg);
+}
+
+
+/**
+ * @brief Reads the length prefixed bytes of a string argument or a field key.
+ * @param arg The tag of the argument, advanced past it.
+ */
+std::string_view read_text(const char*& arg)
+{
+    uint32_t length;
+    std::memcpy(&length, arg + 1, sizeof(length));
+    std::string_view text(arg + 1 + sizeof(length), length);
+    arg += 1 + sizeof(length) + length;
+    return text;
+}
+
+
+/**
+ * @brief Skips a packed argument without rendering it.
+ * @return The first byte after it.
+ */
+const char* skip_arg(const char* arg)
+{
+    switch (type_of(arg))
+    {
+        case log_args::arg_type::string:
+        case log_args::arg_type::key:
+            read_text(arg);
+            return arg;
+        case log_args::arg_type::boolean:
+        case log_args::arg_type::character:
+            return arg + 2;
+        default:
+            return arg + 1 + sizeof(uint64_t);
+    }
+}
+
+
+/**
+ * @brief Renders one packed argument as text.
+ * @return The first byte after it.
+ */
+template <typename Out>
+const char* append_arg(Out& out, const char* arg)
+{
+    char number[32];
+    auto type = type_of(arg);
+    switch (type)
+    {
+        case log_args::arg_type::string:
+        {
+            std::string_view text = read_text(arg);
+            out.append(text.data(), text.size());
+            return arg;
+        }
+        case log_args::arg_type::boolean:
+            out += arg[1] ? "true" : "false";
+            return arg + 2;
+        case log_args::arg_type::character:
+            out += arg[1];
+            return arg + 2;
+        default:
+            break;
+    }
+
+    uint64_t bits;
+    std::memcpy(&bits, arg + 1, sizeof(bits));
+    std::to_chars_result result{number, std::errc()};
+    switch (type)
+    {
+        case log_args::arg_type::i64:
+            result = std::to_chars(number, number + sizeof(number), static_cast<int64_t>(bits));
+            break;
+        case log_args::arg_type::u64:
+            result = std::to_chars(number, number + sizeof(number), bits);
+            break;
+        case log_args::arg_type::f64:
+        {
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            result = std::to_chars(number, number + sizeof(number), value);
+            break;
+        }
+        case log_args::arg_type::pointer:
+            number[0] = '0';
+            number[1] = 'x';
+            result = std::to_chars(number + 2, number + sizeof(number), bits, 16);
+            break;
+        default:
+            break;
+    }
+    out.append(number, static_cast<size_t>(result.ptr - number));
+    return arg + 1 + sizeof(bits);
+}
+
+
+/**
+ * @brief Renders the value of a field as a JSON value: numbers and bools as they are, the rest as strings.
+ * @return The first byte after it.
+ */
+template <typename Out>
+const char* append_json_value(Out& out, const char* arg)
+{
+    switch (type_of(arg))
+    {
+        case log_args::arg_type::i64:
+        case log_args::arg_type::u64:
+        case log_args::arg_type::boolean:
+            return append_arg(out, arg);
+        case log_args::arg_type::f64:
+        {
+            double value;
+            std::memcpy(&value, arg + 1, sizeof(value));
+            if(std::isfinite(value))
+                return append_arg(out, arg);
+            out += "null";
+            return arg + 1 + sizeof(value);
+        }
+        default:
+        {
+            out += '"';
+            escaped_text<Out> text{out};
+            arg = append_arg(text, arg);
+            out += '"';
+            return arg;
+        }
+    }
+}
+
+
+/* Bytes a logfmt value is quoted for and a key can't hold: the space, the control characters,
+   '"', '=', '\\' and everything outside ASCII */
+bool logfmt_special(char c)
+{
+    return static_cast<unsigned char>(c) <= ' ' || static_cast<unsigned char>(c) >= 0x7f || c == '"' || c == '=' ||
+           c == '\\';
+}
+
+
+/**
+ * @brief Appends a logfmt value, quoted and escaped only if it needs to be.
+ */
+template <typename Out>
+void append_logfmt_text(Out& out, std::string_view text)
+{
+    if(!text.empty() && std::none_of(text.begin(), text.end(), logfmt_special))
+        out.append(text.data(), text.size());
+    else
+    {
+        out += '"';
+        escape(out, text.data(), text.size());
+        out += '"';
+    }
+}
+
+
+/**
+ * @brief Appends a logfmt key. A key can't be quoted, the bytes a value would be quoted for become '_'.
+ */
+template <typename Out>
+void append_logfmt_key(Out& out, std::string_view key)
+{
+    if(key.empty())
+        out += '_';
+    for(char c : key)
+        out += logfmt_special(c) ? '_' : c;
+}
+
+
+/**
+ * @brief Renders the value of a field as a logfmt value, quoted only when it has to be.
+ * @return The first byte after it.
+ */
+template <typename Out>
+const char* append_logfmt_value(Out& out, const char* arg)
+{
+    std::string_view text;
+    const char* next = arg;
+    if(type_of(arg) == log_args::arg_type::string)
+    {
+        text = read_text(next);
+    }
+    else if(type_of(arg) == log_args::arg_type::character)
+    {
+        text = std::string_view(arg + 1, 1);
+        next = arg + 2;
+    }
+    else
+        return append_arg(out, arg);
+
+    append_logfmt_text(out, text);
+    return next;
+}
+
+
+/**
+ * @brief Renders the message of a format string, replacing each {} with the next packed argument.
+ * @param arg The first packed argument.
+ * @param end The end of the packed arguments.
+ * @return The first field, or end. Surplus arguments before the fields are skipped.
+ */
+template <typename Out>
+const char* render_message(Out& out, const char* format, const char* arg, const char* end)
+{
+    for(const char* p = format; *p; ++p)
+    {
+        if(p[0] == '{' && p[1] == '{')
+        {
+            out += '{';
+            ++p;
+        }
+        else if(p[0] == '}' && p[1] == '}')
+        {
+            out += '}';
+            ++p;
+        }
+        else if(p[0] == '{' && p[1] == '}' && arg < end && type_of(arg) != log_args::arg_type::key)
+        {
+            arg = append_arg(out, arg);
+            ++p;
+        }
+        else
+        {
+            out += *p;
+        }
+    }
+
+    while(arg < end && type_of(arg) != log_args::arg_type::key)
+        arg = skip_arg(arg);
+    return arg;
+}
+
+
+/**
+ * @brief Renders a format string into a std::string or a fixed_text, see renderFormat.
+ */
+template <typename Out>
+void render(Out& out, const char* format, std::string_view packed_args)
+{
+    const char* end = packed_args.data() + packed_args.size();
+    const char* arg = render_message(out, format, packed_args.data(), end);
+    while(arg < end)
+    {
+        std::string_view key = read_text(arg);
+        out += ' ';
+        out.append(key.data(), key.size());
+        out += '=';
+        if(arg < end)
+            arg = append_arg(out, arg);
+    }
+}
+
+} // namespace
+
+
+/**
+ * @brief Renders a format string, replacing each {} with the next packed argument.
+ * @param out The text is appended here.
+ * @param format The format string. {{ and }} stand for literal braces.
+ * @param packed_args The arguments packed by log_args::pack_all.
+ *
+ * Placeholders without a matching argument are kept as they are, surplus arguments are ignored.
+ * Fields made with log_args::kv are appended as " key=value".
+ */
+void renderFormat(std::string& out, const char* format, std::string_view packed_args)
+{
+    render(out, format, packed_args);
+}
+
+
+/**
+ * @brief Renders a format string into a fixed size buffer, without allocating.
+ * @param out The buffer.
+ * @param capacity The size of the buffer, longer text is cut.
+ * @param format The format string.
+ * @param packed_args The arguments packed by log_args::pack_all.
+ * @return The number of characters written.
+ *
+ * Only calls functions that are safe in a signal handler, used to write the queued records after a crash.
+ */
+size_t renderFormat(char* out, size_t capacity, const char* format, std::string_view packed_args)
+{
+    fixed_text text{out, capacity, 0};
+    render(text, format, packed_args);
+    return text.size;
+}
+
+
+/**
+ * @brief Writes the "[time] [level] [function name] " prefix of a log line.
+ * @param out Destination, log_header_length bytes.
+ * @param time The time the message was logged at, in ns since epoch.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function, cut or padded to the field width.
+ * @param precision The number of fraction digits of the time.
+ * @param signal_safe Whether to use only async-signal-safe calls, see timestamp::format_signal_safe.
+ * @return The number of characters written, always log_header_length.
+ *
+ * Uses precomputed padded level names and writes no terminating null, so no temporaries are needed.
+ */
+size_t formatHeader(char* out, uint64_t time, logging::log_level level, std::string_view fun_name,
+                    timestamp::precision precision, bool signal_safe)
+{
+    static constexpr char padded_levels[][logging::field_width + 1] = {
+        "DEBUG          ",
+        "INFO           ",
+        "WARNING        ",
+        "ERROR          ",
+        "FATAL          ",
+        "UNKNOWN        ",
+    };
+    constexpr size_t width = logging::field_width;
+    size_t level_index = std::min<size_t>(static_cast<size_t>(level), static_cast<size_t>(logging::log_level::UNKNOWN));
+
+    char* p = out;
+    *p++ = '[';
+    size_t time_length = signal_safe ? timestamp::format_signal_safe(time, p, precision)
+                                     : timestamp::format(time, p, precision);
+    std::memset(p + time_length, ' ', width - time_length);
+    p += width;
+    *p++ = ']'; *p++ = ' '; *p++ = '[';
+    std::memcpy(p, padded_levels[level_index], width);
+    p += width;
+    *p++ = ']'; *p++ = ' '; *p++ = '[';
+    size_t fun_length = std::min(fun_name.size(), width);
+    std::memcpy(p, fun_name.data(), fun_length);
+    std::memset(p + fun_length, ' ', width - fun_length);
+    p += width;
+    *p++ = ']'; *p++ = ' ';
+    return static_cast<size_t>(p - out);
+}
+
+
+/**
+ * @brief Formats a whole log line, without the newline.
+ * @param out The line is appended here.
+ * @param layout The layout, see logging::line_format.
+ * @param time The time the message was logged at, in ns since epoch.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function.
+ * @param format The format string of a deferred record, nullptr for a plain message.
+ * @param payload The packed arguments, or the text of a plain message.
+ * @param precision The number of fraction digits of the time in a text line.
+ *
+ * JSON lines are {"ts":<ns since epoch>,"level":"INFO","function":"...","message":"...", fields}
+ * and logfmt lines ts=<ns since epoch> level=INFO function=... msg="..." key=value. The message
+ * and the fields are rendered and escaped straight into out.
+ */
+void formatLine(std::string& out, logging::line_format layout, uint64_t time, logging::log_level level,
+                std::string_view fun_name, const char* format, std::string_view payload,
+                timestamp::precision precision)
+{
+    const char* arg = payload.data();
+    const char* end = arg + payload.size();
+    if(layout == logging::line_format::text)
+    {
+        char header[log_header_length];
+        out.append(header, formatHeader(header, time, level, fun_name, precision));
+        if(format)
+            render(out, format, payload);
+        else
+            out.append(payload.data(), payload.size());
+        return;
+    }
+
+    char number[24];
+    size_t number_length = static_cast<size_t>(std::to_chars(number, number + sizeof(number), time).ptr - number);
+    const char* level_name = level_names[std::min<size_t>(static_cast<size_t>(level), std::size(level_names) - 1)];
+    escaped_text<std::string> message{out};
+
+    if(layout == logging::line_format::json)
+    {
+        out += "{\"ts\":";
+        out.append(number, number_length);
+        out += ",\"level\":\"";
+        out += level_name;
+        out += "\",\"function\":\"";
+        escape(out, fun_name.data(), fun_name.size());
+        out += "\",\"message\":\"";
+        if(format)
+            arg = render_message(message, format, arg, end);
+        else
+        {
+            message.append(payload.data(), payload.size());
+            arg = end;
+        }
+        out += '"';
+        while(arg < end)
+        {
+            std::string_view key = read_text(arg);
+            out += ",\"";
+            escape(out, key.data(), key.size());
+            out += "\":";
+            if(arg < end)
+                arg = append_json_value(out, arg);
+            else
+                out += "null";
+        }
+        out += '}';
+        return;
+    }
+
+    out += "ts=";
+    out.append(number, number_length);
+    out += " level=";
+    out += level_name;
+    out += " function=";
+    append_logfmt_text(out, fun_name);
+    out += " msg=\"";
+    if(format)
+        arg = render_message(message, format, arg, end);
+    else
+    {
+        message.append(payload.data(), payload.size());
+        arg = end;
+    }
+    out += '"';
+    while(arg < end)
+    {
+        std::string_view key = read_text(arg);
+        out += ' ';
+        append_logfmt_key(out, key);
+        out += '=';
+        if(arg < end)
+            arg = append_logfmt_value(out, arg);
+    }
+}
+
+
+/**
+ * @brief Finds the first byte sanitizeText would look at.
+ * @return Its index, text.size() if the text can be written as it is.
+ */
+size_t findUnsafeByte(std::string_view text)
+{
+    return active_scanners().unsafe(text.data(), text.size());
+}
+
+
+/**
+ * @brief Appends text with the bytes that could break the line framing or a terminal escaped.
+ * @param out The sanitized text is appended here.
+ * @param text The text, e.g. a message.
+ *
+ * Newlines and carriage returns become \n and \r, the other control characters but the tab,
+ * DEL and every byte that is not part of a valid UTF-8 sequence become \xNN. Valid UTF-8 is kept.
+ * The runs in between are found 16 or 32 bytes at a time with the vector unit and copied whole.
+ */
+void sanitizeText(std::string& out, std::string_view text)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+    const scan_function find = active_scanners().unsafe;
+    const char* p = text.data();
+    size_t length = text.size();
+    while(length)
+    {
+        size_t run = find(p, length);
+        out.append(p, run);
+        if(run == length)
+            return;
+        p += run;
+        length -= run;
+
+        auto c = static_cast<unsigned char>(*p);
+        size_t size = c >= 0x80 ? utf8_sequence(reinterpret_cast<const unsigned char*>(p), length) : 0;
+        if(size)
+            out.append(p, size);
+        else if(c == '\n')
+            out += "\\n";
+        else if(c == '\r')
+            out += "\\r";
+        else
+        {
+            char escaped[4] = {'\\', 'x', hex[c >> 4], hex[c & 0xf]};
+            out.append(escaped, sizeof(escaped));
+        }
+        size = size ? size : 1;
+        p += size;
+        length -= size;
+    }
+}
+
+
+/**
+ * @brief Get the instruction set the scanners of sanitizeText and the JSON escaping use.
+ * @return "avx2", "sse2", "neon" or "scalar".
+ */
+const char* scannerName()
+{
+    return active_scanners().name;
+}
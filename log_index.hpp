@@ -0,0 +1,184 @@
+/**
+ * @file log_index.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Sparse index of a text log file, written next to it by the writer thread
+ *        and used by logquery to read only the parts of the file a query needs.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * The index of <file>.log is <file>.log.idx, a header followed by one entry per
+ * block of about block_size bytes of lines:
+ *
+ *   header:  "LOGI" version:u32 block_size:u64
+ *   entry:   offset:u64 length:u64 min_time:u64 max_time:u64 levels:u32 lines:u32
+ *
+ * A block starts and ends on a line boundary. Times are nanoseconds since the
+ * Unix epoch, levels has bit 1 << level set for every level in the block. The
+ * values are in host byte order. The lines after the last entry and the parts
+ * of the file that were written without the index are not covered.
+ */
+
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace log_index {
+
+constexpr char magic[4] = {'L', 'O', 'G', 'I'};
+constexpr uint32_t version = 1;
+constexpr char suffix[] = ".idx";
+
+struct header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t block_size;
+};
+
+struct entry
+{
+    uint64_t offset;
+    uint64_t length;
+    uint64_t min_time;
+    uint64_t max_time;
+    uint32_t levels;
+    uint32_t lines;
+};
+
+/**
+ * @brief Appends the entries of one log file to its index.
+ *
+ * Not thread-safe: the logger only calls it from its writer thread, after every line it hands
+ * to the file, so the offsets are only right if nothing else writes to the file.
+ */
+class writer
+{
+private:
+    int fd;
+    uint64_t block_size;
+    uint64_t offset;                // end of the log file, including what is still buffered
+    entry block{};
+
+    writer(int fd, uint64_t block_size, uint64_t offset) : fd(fd), block_size(block_size), offset(offset) {}
+
+    static bool write_all(int fd, const void* data, size_t size)
+    {
+        const char* p = static_cast<const char*>(data);
+        while (size)
+        {
+            ssize_t n = ::write(fd, p, size);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+public:
+    /**
+     * @brief Opens the index of a log file, or starts it.
+     * @param log_path The log file.
+     * @param log_size The size of the log file, the next line is written there.
+     * @param block_size The bytes of lines per entry.
+     * @return The writer, or nullptr if the index can't be opened.
+     * @details An index that points past the end of the log file belongs to a file that was
+     *          replaced, it is started over.
+     */
+    static std::unique_ptr<writer> open(const std::string& log_path, uint64_t log_size, uint64_t block_size)
+    {
+        int fd = ::open((log_path + suffix).c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info;
+        header existing{};
+        entry last{};
+        bool valid = ::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(header) &&
+                     ::pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+                     std::memcmp(existing.magic, magic, sizeof(magic)) == 0 && existing.version == version;
+        if (valid)
+        {
+            // An entry cut off by a crash is dropped, the next one is appended in its place
+            off_t end = info.st_size - static_cast<off_t>((info.st_size - sizeof(header)) % sizeof(entry));
+            if (end != info.st_size)
+                valid = ::ftruncate(fd, end) == 0;
+            if (valid && static_cast<size_t>(end) >= sizeof(header) + sizeof(entry))
+                valid = ::pread(fd, &last, sizeof(last), end - static_cast<off_t>(sizeof(entry))) == sizeof(last) &&
+                        last.offset + last.length <= log_size;
+        }
+
+        if (!valid)
+        {
+            header start{};
+            std::memcpy(start.magic, magic, sizeof(magic));
+            start.version = version;
+            start.block_size = block_size;
+            if (::ftruncate(fd, 0) != 0 || !write_all(fd, &start, sizeof(start)))
+            {
+                ::close(fd);
+                return nullptr;
+            }
+        }
+        return std::unique_ptr<writer>(new writer(fd, block_size, log_size));
+    }
+
+    ~writer()
+    {
+        close_block();
+        ::close(fd);
+    }
+
+    writer(const writer&) = delete;
+    writer& operator=(const writer&) = delete;
+
+    /**
+     * @brief Counts a line written at the end of the log file.
+     * @param time The time of the line, in ns since epoch.
+     * @param level The log level of the line.
+     * @param size The bytes of the line, with the newline.
+     */
+    void add(uint64_t time, uint8_t level, uint64_t size)
+    {
+        if (!block.lines)
+        {
+            block.offset = offset;
+            block.min_time = block.max_time = time;
+        }
+        block.min_time = time < block.min_time ? time : block.min_time;
+        block.max_time = time > block.max_time ? time : block.max_time;
+        block.levels |= 1u << level;
+        ++block.lines;
+        block.length += size;
+        offset += size;
+        if (block.length >= block_size)
+            close_block();
+    }
+
+    /**
+     * @brief Counts bytes written to the log file that are not indexed, e.g. binary records.
+     */
+    void skip(uint64_t size)
+    {
+        close_block();
+        offset += size;
+    }
+
+    /* Writes the entry of the lines since the last one */
+    void close_block()
+    {
+        if (block.lines)
+            write_all(fd, &block, sizeof(block));
+        block = entry{};
+    }
+};
+
+} // namespace log_index
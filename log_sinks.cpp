@@ -0,0 +1,506 @@
+/**
+ * @file log_sinks.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief This file contains the source code of the sinks in log_sinks.hpp.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// <syslog.h> defines LOG_DEBUG, LOG_INFO and LOG_WARNING as priorities, logging.hpp as macros
+#include <syslog.h>
+namespace {
+    // Indexed by logging::log_level
+    constexpr int syslog_priorities[] = {LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR, LOG_CRIT, LOG_NOTICE};
+    static_assert(LOG_USER == 1 << 3, "log_sinks::syslog::user_facility must match LOG_USER");
+}
+#undef LOG_DEBUG
+#undef LOG_INFO
+#undef LOG_WARNING
+
+#include "log_sinks.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define LOGGING_HAVE_ZLIB 1
+#endif
+
+
+/**
+ * @brief Writes a line with its newline.
+ * @param line The line.
+ */
+void log_sinks::console::write(const entry& line)
+{
+    static const char newline = '\n';
+    iovec parts[3] = {{const_cast<char*>(line.header.data()), line.header.size()},
+                      {const_cast<char*>(line.message.data()), line.message.size()},
+                      {const_cast<char*>(&newline), 1}};
+    writev_fully(fd, parts, 3);
+}
+
+
+/**
+ * @brief Opens a file in append mode.
+ * @param path The file to open.
+ * @param buffer_size The number of bytes collected before they are written, 0 writes every line right away.
+ */
+log_sinks::file::file(const std::string& path, size_t buffer_size) : buffer_size(buffer_size)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
+        std::cerr << "Can't open log file " << path << std::endl;
+    buffer.reserve(buffer_size);
+}
+
+
+/**
+ * @brief Flushes the buffered lines and closes the file.
+ */
+log_sinks::file::~file()
+{
+    flush();
+    if(fd >= 0)
+        ::close(fd);
+}
+
+
+/**
+ * @brief Writes a line, or appends it to the buffer when there is one.
+ * @param line The line.
+ */
+void log_sinks::file::write(const entry& line)
+{
+    if(fd < 0)
+        return;
+
+    size_t size = line.header.size() + line.message.size() + 1;
+    if(buffer_size == 0 || size > buffer_size)
+    {
+        flush();
+        static const char newline = '\n';
+        iovec parts[3] = {{const_cast<char*>(line.header.data()), line.header.size()},
+                          {const_cast<char*>(line.message.data()), line.message.size()},
+                          {const_cast<char*>(&newline), 1}};
+        writev_fully(fd, parts, 3);
+        return;
+    }
+
+    if(buffer.size() + size > buffer_size)
+        flush();
+    buffer.append(line.header.data(), line.header.size());
+    buffer.append(line.message.data(), line.message.size());
+    buffer += '\n';
+}
+
+
+/**
+ * @brief Writes the buffered lines with a single write.
+ */
+void log_sinks::file::flush()
+{
+    if(fd < 0 || buffer.empty())
+        return;
+    iovec part = {&buffer[0], buffer.size()};
+    writev_fully(fd, &part, 1);
+    buffer.clear();
+}
+
+
+/**
+ * @brief Opens the connection to the system logger.
+ * @param ident The name syslog puts in front of every message, the program name if empty.
+ * @param facility The syslog facility, LOG_USER by default.
+ */
+log_sinks::syslog::syslog(const std::string& ident, int facility) : ident(ident)
+{
+    ::openlog(this->ident.empty() ? nullptr : this->ident.c_str(), LOG_PID | LOG_NDELAY, facility);
+}
+
+
+/**
+ * @brief Closes the connection to the system logger.
+ */
+log_sinks::syslog::~syslog()
+{
+    ::closelog();
+}
+
+
+/**
+ * @brief Sends a line with the syslog priority of its level.
+ * @param line The line.
+ */
+void log_sinks::syslog::write(const entry& line)
+{
+    size_t index = std::min(static_cast<size_t>(line.level), std::size(syslog_priorities) - 1);
+    ::syslog(syslog_priorities[index], "[%.*s] %.*s",
+             static_cast<int>(line.fun_name.size()), line.fun_name.data(),
+             static_cast<int>(line.message.size()), line.message.data());
+}
+
+
+/**
+ * @brief Resolves the destination and opens a connected UDP socket.
+ * @param host The host name or address of the log collector.
+ * @param port The UDP port of the log collector.
+ *
+ * If the host can't be resolved an error is printed and the lines are discarded.
+ */
+log_sinks::udp::udp(const std::string& host, uint16_t port)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* found = nullptr;
+    if(::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0)
+    {
+        std::cerr << "Can't resolve log host " << host << std::endl;
+        return;
+    }
+
+    for(addrinfo* address = found; address; address = address->ai_next)
+    {
+        fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if(fd < 0)
+            continue;
+        if(::connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+            break;
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(found);
+
+    if(fd < 0)
+        std::cerr << "Can't open a UDP socket to " << host << std::endl;
+}
+
+
+/**
+ * @brief Closes the socket.
+ */
+log_sinks::udp::~udp()
+{
+    if(fd >= 0)
+        ::close(fd);
+}
+
+
+/**
+ * @brief Sends a line as one datagram.
+ * @param line The line.
+ */
+void log_sinks::udp::write(const entry& line)
+{
+    if(fd < 0)
+        return;
+
+    iovec parts[2] = {{const_cast<char*>(line.header.data()), line.header.size()},
+                      {const_cast<char*>(line.message.data()), line.message.size()}};
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    while(::sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR)
+        ;
+}
+
+
+/**
+ * @brief Resolves the collector and starts connecting to it.
+ * @param host The host name or address of the log collector.
+ * @param port Its TCP or UDP port.
+ * @param settings The transport, the frame size, compression and the retry buffer.
+ *
+ * If the host can't be resolved an error is printed and the lines are discarded.
+ */
+log_sinks::network::network(const std::string& host, uint16_t port, const options& settings) : settings(settings)
+{
+#if !LOGGING_HAVE_ZLIB
+    if(settings.compress)
+    {
+        std::cerr << "Built without zlib, the frames to " << host << " are not compressed" << std::endl;
+        this->settings.compress = false;
+    }
+#endif
+    this->settings.frame_size = std::max<size_t>(settings.frame_size, 1);
+    current.reserve(this->settings.frame_size);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = settings.protocol == transport::tcp ? SOCK_STREAM : SOCK_DGRAM;
+    addrinfo* found = nullptr;
+    if(::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || !found)
+    {
+        std::cerr << "Can't resolve log host " << host << std::endl;
+        return;
+    }
+    std::memcpy(&address, found->ai_addr, found->ai_addrlen);
+    address_length = found->ai_addrlen;
+    ::freeaddrinfo(found);
+
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    connect_socket();
+}
+
+
+/**
+ * @brief Sends what it can of the collected lines and closes the socket.
+ */
+log_sinks::network::~network()
+{
+    flush();
+    close_socket();
+}
+
+
+/**
+ * @brief Opens a non-blocking socket to the collector, or checks on a TCP connect in progress.
+ * @return Whether the socket can be written to. Called with frames_mutex held.
+ */
+bool log_sinks::network::connect_socket()
+{
+    if(fd >= 0 && !connecting)
+        return true;
+    if(!address_length)
+        return false;
+
+    if(fd >= 0)
+    {
+        pollfd ready = {fd, POLLOUT, 0};
+        if(::poll(&ready, 1, 0) <= 0)
+            return false;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if(::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+        {
+            close_socket();
+            return false;
+        }
+        connecting = false;
+        return true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if(now < next_connect)
+        return false;
+    next_connect = now + settings.reconnect_interval;
+
+    int type = settings.protocol == transport::tcp ? SOCK_STREAM : SOCK_DGRAM;
+    fd = ::socket(address.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return false;
+    if(::connect(fd, reinterpret_cast<const sockaddr*>(&address), address_length) == 0)
+        return true;
+    if(errno == EINPROGRESS)
+    {
+        connecting = true;
+        return false;
+    }
+    close_socket();
+    return false;
+}
+
+
+/**
+ * @brief Closes the socket, the next send opens a new one once reconnect_interval has elapsed.
+ */
+void log_sinks::network::close_socket()
+{
+    if(fd >= 0)
+        ::close(fd);
+    fd = -1;
+    connecting = false;
+    sent_offset = 0;
+}
+
+
+/**
+ * @brief Whether the socket is open, and for TCP connected.
+ */
+bool log_sinks::network::is_connected() const
+{
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    return fd >= 0 && !connecting;
+}
+
+
+/**
+ * @brief Moves the frame being filled to the retry buffer, compressing it first if asked to.
+ * @details Called with frames_mutex held. Makes room as set by on_full.
+ */
+void log_sinks::network::finish_frame()
+{
+    if(current.empty())
+        return;
+
+    frame next{std::string(), current_lines};
+#if LOGGING_HAVE_ZLIB
+    if(settings.compress)
+    {
+        uLongf size = compressBound(static_cast<uLong>(current.size()));
+        size_t prefix = settings.protocol == transport::tcp ? 4 : 0;
+        next.bytes.resize(prefix + size);
+        if(compress2(reinterpret_cast<Bytef*>(&next.bytes[prefix]), &size,
+                     reinterpret_cast<const Bytef*>(current.data()), static_cast<uLong>(current.size()), 1) == Z_OK)
+        {
+            next.bytes.resize(prefix + size);
+            for(size_t i = 0; i < prefix; ++i)
+                next.bytes[i] = static_cast<char>(size >> (8 * (prefix - 1 - i)));
+        }
+        else
+        {
+            next.bytes.clear();
+        }
+    }
+    else
+#endif
+    {
+        next.bytes.swap(current);
+    }
+    current.clear();
+    current_lines = 0;
+    if(next.bytes.empty())
+    {
+        dropped.fetch_add(next.lines, std::memory_order_relaxed);
+        return;
+    }
+
+    // The first frame may be half sent over TCP, cutting it would break the stream
+    while(unsent_bytes + next.bytes.size() > settings.retry_buffer && !unsent.empty())
+    {
+        if(settings.on_full == full_policy::drop_newest || (unsent.size() == 1 && sent_offset))
+        {
+            dropped.fetch_add(next.lines, std::memory_order_relaxed);
+            return;
+        }
+        auto oldest = unsent.begin() + (sent_offset ? 1 : 0);
+        unsent_bytes -= oldest->bytes.size();
+        dropped.fetch_add(oldest->lines, std::memory_order_relaxed);
+        unsent.erase(oldest);
+    }
+    unsent_bytes += next.bytes.size();
+    unsent.push_back(std::move(next));
+}
+
+
+/**
+ * @brief Sends the frames of the retry buffer until the socket would block.
+ * @details Called with frames_mutex held. A failed socket is closed, its frames are kept.
+ */
+void log_sinks::network::send_unsent()
+{
+    while(!unsent.empty() && connect_socket())
+    {
+        frame& first = unsent.front();
+        ssize_t n = ::send(fd, first.bytes.data() + sent_offset, first.bytes.size() - sent_offset,
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EMSGSIZE)
+            {
+                // Too large for a datagram, sending it again won't help
+                dropped.fetch_add(first.lines, std::memory_order_relaxed);
+                unsent_bytes -= first.bytes.size();
+                unsent.pop_front();
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                close_socket();
+            return;
+        }
+
+        // A datagram is sent whole or not at all
+        sent_offset += static_cast<size_t>(n);
+        if(settings.protocol == transport::tcp && sent_offset < first.bytes.size())
+            continue;
+        unsent_bytes -= first.bytes.size();
+        unsent.pop_front();
+        sent_offset = 0;
+        frames_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+/**
+ * @brief Adds a line to the frame being filled, sending the frame first if the line does not fit.
+ * @param line The line.
+ */
+void log_sinks::network::write(const entry& line)
+{
+    if(!address_length)
+        return;
+
+    size_t size = line.header.size() + line.message.size() + 1;
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    if(!current.empty() && current.size() + size > settings.frame_size)
+    {
+        finish_frame();
+        send_unsent();
+    }
+    current.append(line.header.data(), line.header.size());
+    current.append(line.message.data(), line.message.size());
+    current += '\n';
+    ++current_lines;
+}
+
+
+/**
+ * @brief Sends the frame being filled and retries the frames the socket could not take before.
+ */
+void log_sinks::network::flush()
+{
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    finish_frame();
+    send_unsent();
+}
+
+
+/**
+ * @brief Constructs a ring of the last lines.
+ * @param max_lines The number of lines kept.
+ */
+log_sinks::memory::memory(size_t max_lines) : ring(std::max<size_t>(max_lines, 1))
+{
+}
+
+
+/**
+ * @brief Stores a line, replacing the oldest one when the ring is full.
+ * @param line The line.
+ */
+void log_sinks::memory::write(const entry& line)
+{
+    std::lock_guard<std::mutex> lock(lines_mutex);
+    std::string& slot = ring[next % ring.size()];
+    slot.assign(line.header.data(), line.header.size());
+    slot.append(line.message.data(), line.message.size());
+    ++next;
+}
+
+
+/**
+ * @brief Get a copy of the lines kept.
+ * @return The lines, oldest first, without newlines.
+ */
+std::vector<std::string> log_sinks::memory::lines() const
+{
+    std::lock_guard<std::mutex> lock(lines_mutex);
+    size_t count = std::min(next, ring.size());
+    std::vector<std::string> result;
+    result.reserve(count);
+    for(size_t i = next - count; i < next; ++i)
+        result.push_back(ring[i % ring.size()]);
+    return result;
+}
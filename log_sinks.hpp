@@ -0,0 +1,219 @@
+/**
+ * @file log_sinks.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Sinks that can be added to the logger with logging::add_sink: a console, a file,
+ *        syslog, UDP datagrams, a batching network sink and an in-memory ring of the last lines.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include "logging.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace log_sinks {
+
+/**
+ * @brief Writes every line to a file descriptor, the standard output by default.
+ *
+ * Each line is written with one writev(2), so it is thread-safe. Give it a queue to keep a slow
+ * terminal or a full pipe from holding up the other outputs.
+ */
+class console : public log_sink
+{
+private:
+    int fd;
+
+public:
+    explicit console(int fd = STDOUT_FILENO) : fd(fd) {}
+    void write(const entry& line) override;
+};
+
+
+/**
+ * @brief Appends every line to a file of its own, e.g. to keep the errors in a separate file.
+ *
+ * Without a buffer each line is written with one writev(2) and the sink is thread-safe. With a
+ * buffer the lines are collected and written when it is full or the sink is flushed, which is
+ * only safe when the sink has its own queue.
+ */
+class file : public log_sink
+{
+private:
+    int fd;
+    size_t buffer_size;
+    std::string buffer;
+
+public:
+    explicit file(const std::string& path, size_t buffer_size = 0);
+    ~file() override;
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    void write(const entry& line) override;
+    void flush() override;
+};
+
+
+/**
+ * @brief Sends every line to the system logger with syslog(3).
+ *
+ * The log level is mapped to the syslog priority and syslog adds its own time stamp, so only
+ * "[function] message" is sent. Thread-safe. openlog(3) is process wide, so use one at a time.
+ */
+class syslog : public log_sink
+{
+private:
+    std::string ident;                      // openlog keeps the pointer
+
+public:
+    static constexpr int user_facility = 1 << 3;    // LOG_USER, <syslog.h> is not included as it defines LOG_INFO
+
+    explicit syslog(const std::string& ident = "", int facility = user_facility);
+    ~syslog() override;
+    syslog(const syslog&) = delete;
+    syslog& operator=(const syslog&) = delete;
+
+    void write(const entry& line) override;
+};
+
+
+/**
+ * @brief Sends every line as one UDP datagram, without a trailing newline.
+ *
+ * Sending never blocks, a line the socket can't take right away is lost. Thread-safe.
+ */
+class udp : public log_sink
+{
+private:
+    int fd = -1;
+
+public:
+    udp(const std::string& host, uint16_t port);
+    ~udp() override;
+    udp(const udp&) = delete;
+    udp& operator=(const udp&) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    void write(const entry& line) override;
+};
+
+
+/**
+ * @brief Ships the lines to a log collector over TCP or UDP, batched into frames.
+ *
+ * The lines are collected into a frame, which is sent once the next line would make it larger
+ * than frame_size and whenever the sink is flushed. Over TCP the frames form a stream of
+ * newline-terminated lines, over UDP every frame is one datagram. With compress every frame is
+ * deflated with zlib, and over TCP it is preceded by its compressed length as 4 bytes big-endian.
+ *
+ * The socket never blocks: frames it can't take right away wait in a retry buffer of at most
+ * retry_buffer bytes, and when that is full the oldest or the newest frame is dropped, as set by
+ * on_full. A lost TCP connection is opened again at most once every reconnect_interval and the
+ * frame it cut is sent again whole. Thread-safe, but give it a queue so that the frames are
+ * compressed and sent by its own thread.
+ */
+class network : public log_sink
+{
+public:
+    enum class transport: uint8_t
+    {
+        tcp,
+        udp
+    };
+
+    /* enum class full_policy: which frame is dropped when the retry buffer is full */
+    enum class full_policy: uint8_t
+    {
+        drop_oldest,
+        drop_newest
+    };
+
+    struct options
+    {
+        transport protocol = transport::tcp;
+        size_t frame_size = 1400;                   // fits an Ethernet MTU with the IP and UDP headers
+        bool compress = false;                      // deflate each frame, needs zlib
+        size_t retry_buffer = 1 << 20;              // bytes of frames kept while the collector is away
+        full_policy on_full = full_policy::drop_oldest;
+        std::chrono::milliseconds reconnect_interval{1000};
+    };
+
+private:
+    struct frame
+    {
+        std::string bytes;
+        size_t lines;
+    };
+
+    options settings;
+    sockaddr_storage address{};
+    socklen_t address_length = 0;
+    int fd = -1;
+    bool connecting = false;                    // a TCP connect is in progress
+    std::chrono::steady_clock::time_point next_connect{};
+
+    mutable std::mutex frames_mutex;
+    std::string current;                        // the frame being filled
+    size_t current_lines = 0;
+    std::deque<frame> unsent;                   // finished frames, oldest first
+    size_t unsent_bytes = 0;
+    size_t sent_offset = 0;                     // bytes of the first unsent frame already sent over TCP
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> frames_sent{0};
+
+    void finish_frame();
+    void send_unsent();
+    bool connect_socket();
+    void close_socket();
+
+public:
+    network(const std::string& host, uint16_t port, const options& settings);
+    network(const std::string& host, uint16_t port) : network(host, port, options()) {}
+    ~network() override;
+    network(const network&) = delete;
+    network& operator=(const network&) = delete;
+
+    bool is_resolved() const { return address_length != 0; }
+    bool is_connected() const;
+    uint64_t dropped_lines() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t sent_frames() const { return frames_sent.load(std::memory_order_relaxed); }
+    void write(const entry& line) override;
+    void flush() override;
+};
+
+
+/**
+ * @brief Keeps the last lines in memory, e.g. to attach them to a crash report or show them in a UI.
+ *
+ * The lines are kept in preallocated strings, which keep their capacity when they are reused.
+ * Thread-safe.
+ */
+class memory : public log_sink
+{
+private:
+    mutable std::mutex lines_mutex;
+    std::vector<std::string> ring;
+    size_t next = 0;                        // number of lines written so far
+
+public:
+    explicit memory(size_t max_lines);
+
+    void write(const entry& line) override;
+    std::vector<std::string> lines() const;
+};
+
+} // namespace log_sinks
@@ -0,0 +1,157 @@
+/**
+ * @file logdecode.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Expands a binary log file written with logging::file_format::binary back
+ *        into the "[time] [level] [function] message" text format.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * Usage: logdecode [--us] [--json | --logfmt] <file.log>
+ * The text is written to the standard output. --us prints microsecond timestamps, --json and
+ * --logfmt write the lines in that layout, see logging::line_format.
+ */
+
+#include "logging.hpp"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+
+/**
+ * @brief Decodes every session of a binary log and writes the text lines to stdout.
+ * @param data The file contents.
+ * @param precision The number of fraction digits of the printed times.
+ * @param layout The layout of the printed lines.
+ * @return true if the whole file was decoded, false if it is truncated or corrupt.
+ */
+static bool decode(const std::string& data, timestamp::precision precision, logging::line_format layout)
+{
+    const char* p = data.data();
+    const char* end = p + data.size();
+
+    std::vector<std::string> functions;
+    std::vector<std::string> formats;
+    uint64_t time = 0;
+    std::string text;
+    char header[log_header_length];
+
+    auto read_text = [&](std::vector<std::string>& table) -> bool
+    {
+        uint64_t id, length;
+        if(!binary_format::get_varint(p, end, id) || !binary_format::get_varint(p, end, length) ||
+           length > static_cast<uint64_t>(end - p))
+            return false;
+        if(table.size() <= id)
+            table.resize(id + 1);
+        table[id].assign(p, length);
+        p += length;
+        return true;
+    };
+
+    while(p < end)
+    {
+        if(end - p >= static_cast<ptrdiff_t>(sizeof(binary_format::magic)) &&
+           std::memcmp(p, binary_format::magic, sizeof(binary_format::magic)) == 0)
+        {
+            p += sizeof(binary_format::magic);
+            if(p >= end || static_cast<uint8_t>(*p++) != binary_format::version)
+                return false;
+            if(!binary_format::get_varint(p, end, time))
+                return false;
+            functions.clear();
+            formats.clear();
+            continue;
+        }
+
+        switch (static_cast<binary_format::tag>(*p++))
+        {
+            case binary_format::tag::function_name:
+                if(!read_text(functions))
+                    return false;
+                break;
+
+            case binary_format::tag::format_string:
+                if(!read_text(formats))
+                    return false;
+                break;
+
+            case binary_format::tag::record:
+            {
+                uint64_t delta, fun, fmt, length;
+                if(!binary_format::get_varint(p, end, delta) || p >= end)
+                    return false;
+                auto level = static_cast<logging::log_level>(*p++);
+                if(!binary_format::get_varint(p, end, fun) || !binary_format::get_varint(p, end, fmt) ||
+                   !binary_format::get_varint(p, end, length) || length > static_cast<uint64_t>(end - p) ||
+                   fun >= functions.size() || (fmt != 0 && fmt >= formats.size()))
+                    return false;
+
+                time += static_cast<uint64_t>(binary_format::unzigzag(delta));
+                text.clear();
+                if(layout == logging::line_format::text)
+                {
+                    renderFormat(text, fmt ? formats[fmt].c_str() : "{}", std::string_view(p, length));
+                    formatHeader(header, time, level, functions[fun], precision);
+                    std::fwrite(header, 1, sizeof(header), stdout);
+                }
+                else
+                {
+                    formatLine(text, layout, time, level, functions[fun], fmt ? formats[fmt].c_str() : "{}",
+                               std::string_view(p, length), precision);
+                }
+                p += length;
+
+                text += '\n';
+                std::fwrite(text.data(), 1, text.size(), stdout);
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    timestamp::precision precision = timestamp::precision::milliseconds;
+    logging::line_format layout = logging::line_format::text;
+    const char* path = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--us") == 0)
+            precision = timestamp::precision::microseconds;
+        else if(std::strcmp(argv[i], "--json") == 0)
+            layout = logging::line_format::json;
+        else if(std::strcmp(argv[i], "--logfmt") == 0)
+            layout = logging::line_format::logfmt;
+        else
+            path = argv[i];
+    }
+
+    if(!path)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--us] [--json | --logfmt] <file.log>" << std::endl;
+        return 2;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if(!file.is_open())
+    {
+        std::cerr << "Can't open log file " << path << std::endl;
+        return 1;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    if(!decode(data, precision, layout))
+    {
+        std::cerr << "Log file " << path << " is truncated or corrupt" << std::endl;
+        return 1;
+    }
+    return 0;
+}
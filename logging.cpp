@@ -10,176 +10,3282 @@
  */
 
 #include "logging.hpp"
+#include <algorithm>
 #include <chrono>
-#include <iomanip>
-#include <sstream>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <csignal>
+#include <ctime>
+#include <filesystem>
+#include <vector>
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define LOGGING_HAVE_ZLIB 1
+#endif
+#if defined(__linux__) && __has_include(<linux/futex.h>)
+#include <linux/futex.h>
+#define LOGGING_HAVE_FUTEX 1
+#endif
+#if defined(__linux__) && __has_include(<linux/mempolicy.h>) && defined(SYS_mbind)
+#include <linux/mempolicy.h>
+#define LOGGING_HAVE_MBIND 1
+#endif
 
 
 std::unique_ptr<logging> logging::instance = nullptr;
-namespace logger {
-    logging* log = logging::get_instance("app", true);
+std::atomic<logging*> logging::shared_instance{nullptr};
+std::atomic<logging::channel_map*> logging::channels{nullptr};
+std::mutex logging::channels_mutex;
+std::mutex logging::instance_mutex;
+std::atomic<logging*> logging::crash_logger{nullptr};
+std::terminate_handler logging::previous_terminate = nullptr;
+std::atomic<logging::rate_limit*> logging::limited_sites{nullptr};
+std::atomic<logging::timer_stats*> logging::timed_sites{nullptr};
+static std::atomic<uint64_t> logger_count{0};
+
+
+/**
+ * @brief Monotonic time for the latency stats, in ns.
+ */
+static uint64_t steady_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+/**
+ * @brief Moves the pages of a buffer to the NUMA node of the calling thread.
+ * @details Only the pages that lie completely in the buffer are moved. Does nothing without NUMA support.
+ */
+static void move_to_local_node(const void* data, size_t size)
+{
+#if LOGGING_HAVE_MBIND
+    uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + page - 1) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(data) + size) & ~(page - 1);
+    if(end > begin)
+        ::syscall(SYS_mbind, begin, end - begin, MPOL_LOCAL, nullptr, 0, MPOL_MF_MOVE);
+#else
+    (void)data;
+    (void)size;
+#endif
+}
+
+
+/**
+ * @brief Blocks while a futex word holds a value, for at most timeout ns.
+ * @details Without futexes it sleeps 500 us, the caller looks again then.
+ */
+static void wait_futex(std::atomic<uint32_t>& word, uint32_t value, uint64_t timeout)
+{
+#if LOGGING_HAVE_FUTEX
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the futex word must be a plain uint32_t");
+    timespec limit{static_cast<time_t>(timeout / 1000000000), static_cast<long>(timeout % 1000000000)};
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, value, &limit, nullptr, 0);
+#else
+    (void)word;
+    (void)value;
+    std::this_thread::sleep_for(std::chrono::nanoseconds(std::min<uint64_t>(timeout, 500000)));
+#endif
+}
+
+
+/**
+ * @brief Constructs a new logging instance.
+ * @param filename The filename to log to. If empty, logs to the console only.
+ * @param print_log Whether to print the log to the console.
+ * @param log_mode Whether lines are written on the calling thread or by a background writer.
+ *
+ *If a filename is provided, the log file will be opened in append mode.
+ *If the file cannot be opened, the logger will fall back to printing to the console
+ *and a message will be printed to the standard error stream.
+ *
+ *The constructor also logs a message with the log level UNKNOWN to mark the start
+ *of a new logger.
+ */
+logging::logging(std::string filename , bool print_log, mode log_mode) :filename(filename) , print_log(print_log) ,
+    id(logger_count.fetch_add(1) + 1)
+{
+    if(!filename.empty())
+        sink.store(open_sink(filename));
+
+    if(log_mode == mode::async)
+        start_writer();
+    this->log_mode.store(log_mode, std::memory_order_release);
+    add_log(log_level::UNKNOWN , "New logger" , "============================================");
+}
+
+
+/**
+ * @brief Logs a message with a given log level, function name and message.
+ *
+ * The logged message will have the format "[time] [level] [function name] [message]". The time is the current time in the format
+ * "%Y-%m-%d %H:%M:%S". The level is the string representation of the given log level. The function name is the given function name.
+ * The message is the given message.
+ *
+ * Messages below the level set with set_log_level are discarded before any other work is done, unless the flight
+ * recorder keeps them.
+ * In sync mode the message is written on the calling thread. In async mode the time is taken here and the record is queued
+ * for the writer thread, which does the formatting and the I/O. A FATAL message is flushed before the call returns.
+ */
+void logging::add_log(log_level level, std::string_view fun_name, std::string_view message)
+{
+    if(level < floor_level.load(std::memory_order_relaxed))
+        return;
+    add_message(level, fun_name, nullptr, message);
+}
+
+
+/**
+ * @brief Logs a message from a LOG_* call site.
+ * @param site The static descriptor of the call site, with the level and the function name.
+ * @param message The message to log.
+ * @details Works like add_log(level, fun_name, message), but in async mode only a pointer to
+ *          the call site is queued instead of a copy of the function name.
+ */
+void logging::add_log(const log_site& site, std::string_view message)
+{
+    if(site.level < floor_level.load(std::memory_order_relaxed))
+        return;
+    add_message(site.level, site.get_name(), &site, message);
+}
+
+
+/**
+ * @brief Writes or queues a plain message that passed the level check.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function that is logging.
+ * @param site The call site, nullptr if the message was not logged by a LOG_* macro.
+ * @param message The message to log.
+ */
+void logging::add_message(log_level level, std::string_view fun_name, const log_site* site, std::string_view message)
+{
+    if(level < this->level.load(std::memory_order_relaxed))
+    {
+        capture(level, fun_name, site, nullptr, message.data(), message.size());
+        return;
+    }
+
+    uint64_t now = count_record(level);
+    if((level == log_level::ERROR || level == log_level::FATAL) && flight_capacity.load(std::memory_order_relaxed))
+        dump_flight(now);
+    emit_record(now, level, fun_name, site, nullptr, message);
+    // The process is likely about to die, the line must not wait in the queue
+    if(level == log_level::FATAL && log_mode.load(std::memory_order_relaxed) == mode::async)
+        flush();
+}
+
+
+/**
+ * @brief Writes or queues a record, a plain message or a deferred one.
+ * @param time The time of the record.
+ * @param format The format string of a deferred record, nullptr for a plain message.
+ * @param payload The packed arguments, or the text of a plain message.
+ */
+void logging::emit_record(uint64_t time, log_level level, std::string_view fun_name, const log_site* site,
+                          const char* format, std::string_view payload)
+{
+    if(log_mode.load(std::memory_order_acquire) == mode::async)
+    {
+        push_record(local_queue(), policy.load(std::memory_order_relaxed), time, level, fun_name, site, format,
+                    payload.size(), [payload](char* out) { std::memcpy(out, payload.data(), payload.size()); });
+        notify_writer();
+        return;
+    }
+    write_log(time, level, fun_name, payload, format);
+}
+
+
+/**
+ * @brief Starts a batch of lines logged together, see log_batch.
+ * @return The batch, it commits its lines when it goes out of scope.
+ * @details auto lines = logger::log->batch(); lines.add(...); ... lines.commit();
+ */
+logging::log_batch logging::batch()
+{
+    return log_batch(this);
+}
+
+
+/**
+ * @brief Adds a plain message to the batch.
+ * @details Messages below the log level are dropped here, or go to the flight recorder if it keeps them.
+ */
+void logging::log_batch::add(log_level level, std::string_view fun_name, std::string_view message)
+{
+    if(level < owner->level.load(std::memory_order_relaxed))
+    {
+        if(level >= owner->floor_level.load(std::memory_order_relaxed))
+            owner->add_message(level, fun_name, nullptr, message);
+        return;
+    }
+    std::memcpy(append(level, fun_name, nullptr, message.size()), message.data(), message.size());
+}
+
+
+/**
+ * @brief Adds the header of a line and makes room for its payload.
+ * @return Where the payload goes, valid until the next add.
+ */
+char* logging::log_batch::append(log_level level, std::string_view fun_name, const char* format, size_t payload_size)
+{
+    if(!time)
+        time = timestamp::now();
+    thread_stats& counters = owner->local_stats();
+    thread_stats::add(counters.records[std::min(static_cast<size_t>(level), level_count - 1)], 1);
+    if(level > worst && level != log_level::UNKNOWN)
+        worst = level;
+    ++count;
+
+    batch_entry entry;
+    entry.format = format;
+    entry.length = static_cast<uint32_t>(payload_size);
+    entry.level = level;
+    entry.fun_length = static_cast<uint8_t>(std::min(fun_name.size(), field_width));
+    std::memcpy(entry.fun_name, fun_name.data(), entry.fun_length);
+
+    size_t pos = entries.size();
+    entries.resize(pos + sizeof(entry) + payload_size);
+    std::memcpy(&entries[pos], &entry, sizeof(entry));
+    return &entries[pos + sizeof(entry)];
+}
+
+
+/**
+ * @brief Logs the lines added so far, the batch can be used again afterwards.
+ */
+void logging::log_batch::commit()
+{
+    if(!entries.empty())
+        owner->commit_batch(time, worst, entries);
+    discard();
+}
+
+
+/**
+ * @brief Drops the lines added so far without logging them.
+ */
+void logging::log_batch::discard()
+{
+    entries.clear();
+    count = 0;
+    time = 0;
+    worst = log_level::DEBUG;
+}
+
+
+/**
+ * @brief Calls write_entry(level, fun_name, format, payload) for every line of a log_batch, in order.
+ */
+template <typename F>
+void logging::for_each_entry(std::string_view entries, const F& write_entry)
+{
+    batch_entry entry;
+    for(size_t pos = 0; pos + sizeof(entry) <= entries.size(); pos += sizeof(entry) + entry.length)
+    {
+        std::memcpy(&entry, &entries[pos], sizeof(entry));
+        write_entry(entry.level, std::string_view(entry.fun_name, entry.fun_length), entry.format,
+                    entries.substr(pos + sizeof(entry), entry.length));
+    }
+}
+
+
+/**
+ * @brief Logs the lines of a log_batch.
+ * @param time The time stamp the lines share.
+ * @param worst The highest level among the lines.
+ * @param entries The lines.
+ *
+ * In async mode the lines are queued as one record, which the writer thread writes in one go. In
+ * sync mode they are formatted into a per-thread buffer, which goes to the console and the file
+ * with one write each. The sinks get the lines one by one.
+ */
+void logging::commit_batch(uint64_t time, log_level worst, std::string_view entries)
+{
+    if((worst == log_level::ERROR || worst == log_level::FATAL) && flight_capacity.load(std::memory_order_relaxed))
+        dump_flight(time);
+
+    if(log_mode.load(std::memory_order_acquire) == mode::async)
+    {
+        push_record(local_queue(), policy.load(std::memory_order_relaxed), time, worst, "", nullptr,
+                    batch_format, entries.size(),
+                    [entries](char* out) { std::memcpy(out, entries.data(), entries.size()); });
+        notify_writer();
+        if(worst == log_level::FATAL)
+            flush();
+        return;
+    }
+
+    thread_local std::string lines;
+    lines.clear();
+    for_each_entry(entries, [this, time](log_level level, std::string_view fun_name, const char* format,
+                                         std::string_view payload)
+                   {
+                       write_log(time, level, fun_name, payload, format, &lines);
+                   });
+
+    iovec part = {&lines[0], lines.size()};
+    thread_stats& counters = local_stats();
+    if(print_log.load(std::memory_order_relaxed))
+    {
+        writev_fully(STDOUT_FILENO, &part, 1);
+        thread_stats::add(counters.bytes, lines.size());
+    }
+
+    epoch::guard guard;
+    file_sink* current = sink.load();
+    if(current)
+    {
+        current->write_direct(&part, 1);
+        thread_stats::add(counters.bytes, lines.size());
+    }
+}
+
+
+/**
+ * @brief Logs a deferred record, called by the variadic add_log with its arguments type erased.
+ * @param level The log level of the message.
+ * @param threshold The level of the logger or channel, a record below it only goes to the flight recorder.
+ * @param fun_name The name of the function that is logging.
+ * @param site The call site, nullptr if the message was not logged by a LOG_* macro.
+ * @param format The format string with {} placeholders.
+ * @param packed_size The number of bytes the packed arguments take.
+ * @param pack Writes the packed arguments.
+ * @param args The arguments, passed back to pack.
+ *
+ * In async mode the arguments are packed straight into the ring buffer slot and rendered by the
+ * writer thread. In sync mode they are packed in a per-thread buffer and written right away.
+ */
+void logging::add_deferred(log_level level, log_level threshold, std::string_view fun_name, const log_site* site,
+                           const char* format, size_t packed_size, pack_function pack, const void* args)
+{
+    if(level < threshold)
+    {
+        // Arguments that don't fit are left out, the format string is kept with its placeholders
+        char packed[flight_payload_size];
+        bool fits = packed_size <= sizeof(packed);
+        if(fits)
+            pack(packed, args);
+        capture(level, fun_name, site, format, packed, fits ? packed_size : 0);
+        return;
+    }
+
+    uint64_t now = count_record(level);
+    if((level == log_level::ERROR || level == log_level::FATAL) && flight_capacity.load(std::memory_order_relaxed))
+        dump_flight(now);
+    if(log_mode.load(std::memory_order_acquire) == mode::async)
+    {
+        push_record(local_queue(), policy.load(std::memory_order_relaxed), now, level, fun_name, site, format,
+                    packed_size, [pack, args](char* out) { pack(out, args); });
+        notify_writer();
+        if(level == log_level::FATAL)
+            flush();
+        return;
+    }
+
+    thread_local std::string packed;
+    packed.resize(packed_size);
+    pack(&packed[0], args);
+    write_log(now, level, fun_name, packed, format);
+}
+
+
+/**
+ * @brief Log a message with the default log level.
+ * @param fun_name The name of the function that is logging.
+ * @param message The message to log.
+ * @details This function logs the message with the default log level.
+ */
+void logging::add_log(std::string_view fun_name, std::string_view message)
+{
+    add_log(level.load(std::memory_order_relaxed), fun_name, message);
+}
+
+
+/**
+ * @brief Formats a log line and writes it to the console and the log file.
+ * @param time The time the message was logged at, in ns since epoch.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function that logged the message.
+ * @param message The message to log, or the packed arguments of a deferred record.
+ * @param format The format string of a deferred record, nullptr for a plain message.
+ * @param collect If set, the console and file line is appended to it instead of being written, see commit_batch.
+ *
+ * If the logger is set to print the logs to the console, the logged message will be printed to the console. If the logger is set to log
+ * to a file, the logged message will be appended to the file. The header is formatted on the stack and written together with
+ * the message by one writev(2) call, so lines from different threads never interleave, no lock is needed and nothing is
+ * allocated. The file is opened with O_APPEND, which moves the end-of-file seek into the kernel.
+ * JSON and logfmt lines are formatted into a per-thread buffer and written with one write as well.
+ * The sinks added with add_sink get the text line last.
+ */
+void logging::write_log(uint64_t time, log_level level, std::string_view fun_name, std::string_view message,
+                        const char* format, std::string* collect)
+{
+    line_format layout = line_fmt.load(std::memory_order_relaxed);
+    bool has_sinks = sinks.load() != nullptr;
+    bool text_needed = layout == line_format::text || has_sinks;
+    timestamp::precision precision = time_precision.load(std::memory_order_relaxed);
+    thread_stats& counters = local_stats();
+    bool timed = thread_stats::sample(counters.format_countdown);
+    uint64_t start = timed ? steady_ns() : 0;
+
+    std::string_view payload = message;
+    thread_local std::string text;
+    if(format && text_needed)
+    {
+        text.clear();
+        renderFormat(text, format, payload);
+        message = text;
+    }
+    thread_local std::string clean;
+    if(text_needed && sanitize.load(std::memory_order_relaxed) && findUnsafeByte(message) != message.size())
+    {
+        clean.clear();
+        sanitizeText(clean, message);
+        message = clean;
+    }
+
+    // [time] [level] [function name] [message]
+    char header[log_header_length];
+    if(text_needed)
+        formatHeader(header, time, level, fun_name, precision);
+
+    thread_local std::string line;
+    if(layout != line_format::text)
+    {
+        line.clear();
+        formatLine(line, layout, time, level, fun_name, format, payload, precision);
+        line += '\n';
+    }
+    if(timed)
+    {
+        thread_stats::add(counters.format_samples, 1);
+        thread_stats::add(counters.format_ns, steady_ns() - start);
+    }
+
+    static const char newline = '\n';
+    iovec parts[3];
+    auto line_parts = [&]()
+    {
+        if(layout != line_format::text)
+        {
+            parts[0] = {&line[0], line.size()};
+            return 1;
+        }
+        parts[0] = {header, sizeof(header)};
+        parts[1] = {const_cast<char*>(message.data()), message.size()};
+        parts[2] = {const_cast<char*>(&newline), 1};
+        return 3;
+    };
+    size_t line_size = layout != line_format::text ? line.size() : sizeof(header) + message.size() + 1;
+
+    if(collect)
+    {
+        int count = line_parts();
+        for(int i = 0; i < count; ++i)
+            collect->append(static_cast<const char*>(parts[i].iov_base), parts[i].iov_len);
+    }
+    else if(print_log.load(std::memory_order_relaxed))
+    {
+        int count = line_parts();
+        writev_fully(STDOUT_FILENO, parts, count);
+        thread_stats::add(counters.bytes, line_size);
+    }
+
+    epoch::guard guard;
+    file_sink* current = sink.load();
+    if(current && !collect)
+    {
+        int count = line_parts();
+        current->write_direct(parts, count);
+        thread_stats::add(counters.bytes, line_size);
+    }
+
+    if(has_sinks)
+        write_sinks(time, level, fun_name, message, std::string_view(header, sizeof(header)));
+}
+
+
+/**
+ * @brief Queues a record, applying the overflow policy when the queue is full.
+ * @param target The queue, of the calling thread or of a sink.
+ * @param overflow What to do when the queue is full.
+ * @param time The time the message was logged at, in ns since epoch.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function that logged the message.
+ * @param site The call site of a LOG_* call, its name is used instead of copying fun_name.
+ * @param format The format string of a deferred record, nullptr for a plain message.
+ * @param payload_size The size of the message or of the packed arguments.
+ * @param write_payload Writes the payload to the char* it is given.
+ *
+ * The fields are copied straight into the ring buffer slot. Only a payload longer than
+ * inline_message_size goes to a buffer of its size class from the calling thread's spill_pool,
+ * which the consumer gives back once the record is written.
+ */
+template <typename F>
+void logging::push_record(ring_buffer<log_record>& target, overflow_policy overflow, uint64_t time,
+                          log_level level, std::string_view fun_name, const log_site* site, const char* format,
+                          size_t payload_size, const F& write_payload)
+{
+    auto fill = [&](log_record& record)
+    {
+        record.time = time;
+        record.level = level;
+        record.site = site;
+        if(!site)
+        {
+            record.fun_length = static_cast<uint8_t>(std::min(fun_name.size(), field_width));
+            std::memcpy(record.fun_name, fun_name.data(), record.fun_length);
+        }
+        record.format = format;
+        record.message_length = static_cast<uint32_t>(payload_size);
+        if(payload_size <= inline_message_size)
+        {
+            write_payload(record.message);
+        }
+        else
+        {
+            record.spill = spill_pool::allocate(payload_size);
+            write_payload(record.spill);
+        }
+    };
+
+    if(target.try_emplace(fill))
+        return;
+
+    switch (overflow)
+    {
+        case overflow_policy::drop_newest:
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+
+        case overflow_policy::drop_oldest:
+            while(!target.try_emplace(fill))
+            {
+                if(target.try_consume([](log_record& oldest) { oldest.release(); }))
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+
+        case overflow_policy::block:
+        default:
+            while(!target.try_emplace(fill))
+                std::this_thread::yield();
+            return;
+    }
+}
+
+
+/**
+ * @brief Get the async queue of the calling thread, creating it on its first use.
+ * @return The queue.
+ *
+ * Every logging thread pushes into a queue of its own, so the threads never write to a shared
+ * cache line and the writer thread takes the records off each queue in batches. The queue is
+ * marked abandoned when the thread exits and freed by the writer thread once it is empty.
+ */
+ring_buffer<logging::log_record>& logging::local_queue()
+{
+    struct local
+    {
+        uint64_t owner = 0;
+        std::shared_ptr<thread_queue> queue;
+
+        ~local()
+        {
+            if(queue)
+                queue->abandoned.store(true, std::memory_order_release);
+        }
+    };
+    thread_local local cached;
+
+    if(cached.owner != id)
+    {
+        if(cached.queue)
+            cached.queue->abandoned.store(true, std::memory_order_release);
+        cached.queue = std::make_shared<thread_queue>(queue_capacity.load(std::memory_order_relaxed));
+        cached.owner = id;
+        if(numa_local.load(std::memory_order_relaxed))
+            move_to_local_node(cached.queue->records.storage(), cached.queue->records.storage_size());
+
+        std::lock_guard<std::mutex> lock(queues_mutex);
+        thread_queues.push_back(cached.queue);
+        publish_crash_queues();
+        queues_version.fetch_add(1, std::memory_order_release);
+    }
+    return cached.queue->records;
+}
+
+
+/**
+ * @brief Get the counters of the calling thread, creating them on its first use.
+ * @return The counters.
+ *
+ * The counters of the threads that have exited are folded into retired_stats here, so the
+ * list only holds the running threads.
+ */
+logging::thread_stats& logging::local_stats()
+{
+    struct local
+    {
+        uint64_t owner = 0;
+        std::shared_ptr<thread_stats> counters;
+
+        ~local()
+        {
+            if(counters)
+                counters->abandoned.store(true, std::memory_order_release);
+        }
+    };
+    thread_local local cached;
+
+    if(cached.owner != id)
+    {
+        if(cached.counters)
+            cached.counters->abandoned.store(true, std::memory_order_release);
+        cached.counters = std::make_shared<thread_stats>();
+        cached.owner = id;
+
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        auto gone = [this](const std::shared_ptr<thread_stats>& counters)
+        {
+            if(!counters->abandoned.load(std::memory_order_acquire))
+                return false;
+            for(size_t i = 0; i < level_count; ++i)
+                retired_stats.records[i] += counters->records[i].load(std::memory_order_relaxed);
+            retired_stats.bytes_written += counters->bytes.load(std::memory_order_relaxed);
+            retired_stats.clock_samples += counters->clock_samples.load(std::memory_order_relaxed);
+            retired_stats.clock_ns += counters->clock_ns.load(std::memory_order_relaxed);
+            retired_stats.format_samples += counters->format_samples.load(std::memory_order_relaxed);
+            retired_stats.format_ns += counters->format_ns.load(std::memory_order_relaxed);
+            return true;
+        };
+        thread_counters.erase(std::remove_if(thread_counters.begin(), thread_counters.end(), gone),
+                              thread_counters.end());
+        thread_counters.push_back(cached.counters);
+    }
+    return *cached.counters;
+}
+
+
+
+/**
+ * @brief Stores a record in the next slot, overwriting the oldest one. Called by the owner thread only.
+ */
+void logging::flight_ring::store(const flight_record& record)
+{
+    uint64_t words[sizeof(flight_record) / sizeof(uint64_t)];
+    std::memcpy(words, &record, sizeof(record));
+
+    uint64_t index = written.load(std::memory_order_relaxed);
+    flight_slot& slot = slots[index % capacity];
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    written.store(index + 1, std::memory_order_release);
+}
+
+
+/**
+ * @brief Copies the record of a slot out, from any thread.
+ * @return false if the owner was writing the slot meanwhile. The record may be newer than index
+ *         if the slot was overwritten before the copy, the caller filters by time.
+ */
+bool logging::flight_ring::load(uint64_t index, flight_record& record) const
+{
+    uint64_t words[sizeof(flight_record) / sizeof(uint64_t)];
+    const flight_slot& slot = slots[index % capacity];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if(sequence & 1)
+        return false;
+    for(size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(slot.sequence.load(std::memory_order_relaxed) != sequence)
+        return false;
+    std::memcpy(&record, words, sizeof(record));
+    return true;
+}
+
+
+/**
+ * @brief Get the flight recorder ring of the calling thread, creating it on its first use.
+ * @return The ring, nullptr if the recorder is off.
+ * @details A new ring is made when the capacity was changed. The rings of the threads that have
+ *          exited are dropped here, their records are not dumped anymore.
+ */
+logging::flight_ring* logging::local_flight()
+{
+    struct local
+    {
+        uint64_t owner = 0;
+        std::shared_ptr<flight_ring> ring;
+
+        ~local()
+        {
+            if(ring)
+                ring->abandoned.store(true, std::memory_order_release);
+        }
+    };
+    thread_local local cached;
+
+    size_t capacity = flight_capacity.load(std::memory_order_relaxed);
+    if(!capacity)
+        return nullptr;
+    if(cached.owner != id || cached.ring->capacity != capacity)
+    {
+        if(cached.ring)
+            cached.ring->abandoned.store(true, std::memory_order_release);
+        cached.ring = std::make_shared<flight_ring>(capacity);
+        cached.owner = id;
+
+        std::lock_guard<std::mutex> lock(flight_mutex);
+        auto gone = [](const std::shared_ptr<flight_ring>& ring)
+        {
+            return ring->abandoned.load(std::memory_order_acquire);
+        };
+        flight_rings.erase(std::remove_if(flight_rings.begin(), flight_rings.end(), gone), flight_rings.end());
+        flight_rings.push_back(cached.ring);
+    }
+    return cached.ring.get();
+}
+
+
+/**
+ * @brief Keeps a record below the log level in the calling thread's flight recorder ring.
+ * @param payload The text of a plain message or the packed arguments, cut to flight_payload_size.
+ */
+void logging::capture(log_level level, std::string_view fun_name, const log_site* site, const char* format,
+                      const char* payload, size_t size)
+{
+    flight_ring* ring = local_flight();
+    if(!ring)
+        return;
+
+    flight_record record{};
+    record.time = timestamp::now();
+    record.site = site;
+    record.format = format;
+    record.level = level;
+    if(!site)
+    {
+        record.fun_length = static_cast<uint8_t>(std::min(fun_name.size(), field_width));
+        std::memcpy(record.fun_name, fun_name.data(), record.fun_length);
+    }
+    record.length = static_cast<uint32_t>(std::min(size, flight_payload_size));
+    std::memcpy(record.payload, payload, record.length);
+    ring->store(record);
+}
+
+
+/**
+ * @brief Writes the flight recorder records of all the threads ahead of an error.
+ * @param now The time of the error. Only the records between the previous dump and it are written.
+ * @details The records of all the rings are sorted by time, the newest flight_dump records are kept.
+ *          The records go the way of any other, so they keep their level and the sink levels apply to them.
+ */
+void logging::dump_flight(uint64_t now)
+{
+    std::vector<std::shared_ptr<flight_ring>> rings;
+    uint64_t since;
+    {
+        std::lock_guard<std::mutex> lock(flight_mutex);
+        if(now <= flight_dumped)
+            return;
+        since = flight_dumped;
+        flight_dumped = now;
+        rings = flight_rings;
+    }
+
+    size_t limit = flight_dump.load(std::memory_order_relaxed);
+    std::vector<flight_record> records;
+    flight_record record;
+    for(const auto& ring : rings)
+    {
+        uint64_t end = ring->written.load(std::memory_order_acquire);
+        uint64_t begin = end - std::min<uint64_t>(end, std::min<uint64_t>(ring->capacity, limit));
+        for(uint64_t i = begin; i < end; ++i)
+            if(ring->load(i, record) && record.time > since && record.time <= now)
+                records.push_back(record);
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const flight_record& a, const flight_record& b) { return a.time < b.time; });
+    if(records.empty())
+        return;
+    if(records.size() > limit)
+        records.erase(records.begin(), records.end() - limit);
+
+    std::string count = std::to_string(records.size()) + " records before the error";
+    emit_record(records.front().time, log_level::UNKNOWN, "Flight recorder", nullptr, nullptr, count);
+    for(const flight_record& r : records)
+        emit_record(r.time, r.level, r.get_fun_name(), r.site, r.format, std::string_view(r.payload, r.length));
+}
+
+
+/**
+ * @brief Counts a record of the calling thread and takes its time stamp.
+ * @param level The log level of the record.
+ * @return The current time, in ns since epoch.
+ * @details Every sample_interval-th call also measures how long reading the clock takes.
+ */
+uint64_t logging::count_record(log_level level)
+{
+    thread_stats& counters = local_stats();
+    thread_stats::add(counters.records[std::min(static_cast<size_t>(level), level_count - 1)], 1);
+    if(!thread_stats::sample(counters.clock_countdown))
+        return timestamp::now();
+
+    uint64_t start = steady_ns();
+    uint64_t now = timestamp::now();
+    thread_stats::add(counters.clock_samples, 1);
+    thread_stats::add(counters.clock_ns, steady_ns() - start);
+    return now;
+}
+
+
+/**
+ * @brief Writes a queued record, one line or the lines of a log_batch.
+ * @param record The record, still in its ring buffer slot.
+ */
+void logging::write_record(const log_record& record)
+{
+    if(record.format == batch_format)
+    {
+        for_each_entry(record.get_message(),
+                       [this, &record](log_level level, std::string_view fun_name, const char* format,
+                                       std::string_view payload)
+                       {
+                           write_entry(record.time, level, fun_name, nullptr, format, payload);
+                       });
+        return;
+    }
+    write_entry(record.time, record.level, record.get_fun_name(), record.site, record.format, record.get_message());
+}
+
+
+/**
+ * @brief Writes a line taken off a queue, rendering it first if it is a deferred one.
+ * @param time The time of the line, in ns since epoch.
+ * @param site The call site of a LOG_* call, lets the binary encoder look the name up by address.
+ * @param format The format string of a deferred line, nullptr for a plain message.
+ * @param payload The packed arguments, or the message of a plain line.
+ *
+ * The console gets the line right away. The file gets the text, JSON or logfmt line, or the
+ * encoded record in binary file format, through the write combining buffer of the file. The buffer is flushed
+ * when it is full, when the flush interval has elapsed and right away for ERROR and above.
+ * The sinks added with add_sink get the text line after the console.
+ */
+void logging::write_entry(uint64_t time, log_level level, std::string_view fun_name, const log_site* site,
+                          const char* format, std::string_view payload)
+{
+    // The format is the one the file was opened with, so a file never mixes both
+    epoch::guard guard;
+    file_sink* current = sink.load();
+    bool binary = current && current->format == file_format::binary;
+    bool console = print_log.load(std::memory_order_relaxed);
+    line_format layout = line_fmt.load(std::memory_order_relaxed);
+    bool line_needed = console || !binary;
+    bool text_needed = (layout == line_format::text && line_needed) || sinks.load(std::memory_order_relaxed);
+    bool structured = layout != line_format::text && line_needed;
+    timestamp::precision precision = time_precision.load(std::memory_order_relaxed);
+    std::string_view message = payload;
+    thread_stats& counters = local_stats();
+    bool timed = (text_needed || structured) && thread_stats::sample(counters.format_countdown);
+    uint64_t start = timed ? steady_ns() : 0;
+
+    thread_local std::string text;
+    if(format && text_needed)
+    {
+        text.clear();
+        renderFormat(text, format, message);
+        message = text;
+    }
+    thread_local std::string clean;
+    if(text_needed && sanitize.load(std::memory_order_relaxed) && findUnsafeByte(message) != message.size())
+    {
+        clean.clear();
+        sanitizeText(clean, message);
+        message = clean;
+    }
+
+    static const char newline = '\n';
+    char header[log_header_length];
+    if(text_needed)
+        formatHeader(header, time, level, fun_name, precision);
+
+    thread_local std::string line;
+    if(structured)
+    {
+        line.clear();
+        formatLine(line, layout, time, level, fun_name, format,
+                   payload, precision);
+        line += '\n';
+    }
+    if(timed)
+    {
+        thread_stats::add(counters.format_samples, 1);
+        thread_stats::add(counters.format_ns, steady_ns() - start);
+    }
+
+    iovec parts[3];
+    auto line_parts = [&]()
+    {
+        if(structured)
+        {
+            parts[0] = {&line[0], line.size()};
+            return 1;
+        }
+        parts[0] = {header, sizeof(header)};
+        parts[1] = {const_cast<char*>(message.data()), message.size()};
+        parts[2] = {const_cast<char*>(&newline), 1};
+        return 3;
+    };
+    size_t line_size = structured ? line.size() : sizeof(header) + message.size() + 1;
+
+    if(console)
+    {
+        int count = line_parts();
+        writev_fully(STDOUT_FILENO, parts, count);
+        thread_stats::add(counters.bytes, line_size);
+    }
+
+    if(sinks.load())
+        write_sinks(time, level, fun_name, message,
+                    std::string_view(header, sizeof(header)));
+
+    if(!current)
+        return;
+
+    size_t buffer_size = file_buffer_size.load(std::memory_order_relaxed);
+    if(binary)
+    {
+        // The writer thread owns the encoder state. A file swapped in by change_log_file starts a new session
+        if(!current->encoder)
+            current->encoder.reset(new binary_format::encoder);
+
+        thread_local std::string encoded;
+        encoded.clear();
+        current->encoder->encode(encoded, time, static_cast<uint8_t>(level), fun_name,
+                                 format, payload, site);
+        parts[0] = {&encoded[0], encoded.size()};
+        current->write(parts, 1, buffer_size);
+        thread_stats::add(counters.bytes, encoded.size());
+        if(current->index)
+            current->index->skip(encoded.size());
+    }
+    else
+    {
+        int count = line_parts();
+        current->write(parts, count, buffer_size);
+        thread_stats::add(counters.bytes, line_size);
+        if(current->index)
+            current->index->add(time, static_cast<uint8_t>(level), line_size);
+    }
+
+    // The interval is measured on the writer's clock: a deferred record may be older than the last flush
+    uint64_t now = timestamp::now();
+    if(level >= log_level::ERROR ||
+       now - current->last_flush >= flush_interval_ns.load(std::memory_order_relaxed))
+        current->flush(now);
+}
+
+
+/**
+ * @brief Flushes the write combining buffer of the log file once the flush interval has elapsed.
+ * @param force Flush regardless of the interval.
+ * @return Whether data is left to write, in the buffer or waiting for io_uring.
+ * @details Called by the writer thread while the queue is empty. Also starts the next io_uring
+ *          write once the previous one is done, and a forced flush waits for them.
+ */
+bool logging::flush_idle(bool force)
+{
+    epoch::guard guard;
+    file_sink* current = sink.load();
+    if(!current)
+        return false;
+    if(current->uring)
+        current->uring->pump();
+    if(current->used == 0 && !force)
+        return current->uring && !current->uring->idle();
+
+    uint64_t now = timestamp::now();
+    if(force || now - current->last_flush >= flush_interval_ns.load(std::memory_order_relaxed))
+        current->flush(now);
+    if(force && current->uring)
+        current->uring->wait_all();
+    return current->used != 0 || (current->uring && !current->uring->idle());
+}
+
+
+/**
+ * @brief Hands a line to the sinks added with add_sink whose level it passes.
+ * @param time The time the message was logged at, in ns since epoch.
+ * @param level The log level of the message.
+ * @param fun_name The name of the function that logged the message.
+ * @param message The rendered message.
+ * @param header The header formatted by formatHeader.
+ *
+ * Sinks with a queue get a copy of the line in their queue, so a slow sink only holds up its
+ * own thread. The others are written right away. The caller must hold an epoch::guard.
+ */
+void logging::write_sinks(uint64_t time, log_level level, std::string_view fun_name, std::string_view message,
+                          std::string_view header)
+{
+    sink_list* list = sinks.load();
+    if(!list)
+        return;
+
+    for(sink_slot* slot : list->slots)
+    {
+        if(level < slot->options.level)
+            continue;
+
+        if(!slot->queue)
+        {
+            write_to_sink(*slot, time, level, fun_name, message, header);
+            continue;
+        }
+        push_record(*slot->queue, slot->options.policy, time, level, fun_name, nullptr, nullptr, message.size(),
+                    [message](char* out) { std::memcpy(out, message.data(), message.size()); });
+    }
+}
+
+
+/**
+ * @brief Writes a line to one sink and flushes it when the line is an ERROR or worse or the flush interval has elapsed.
+ * @return true if the sink was flushed.
+ */
+bool logging::write_to_sink(sink_slot& slot, uint64_t time, log_level level, std::string_view fun_name,
+                            std::string_view message, std::string_view header)
+{
+    slot.output->write(log_sink::entry{time, level, fun_name, header, message});
+
+    // Not the record time, the records of the threads writing an inline sink arrive out of order
+    uint64_t now = timestamp::now();
+    uint64_t last = slot.last_flush.load(std::memory_order_relaxed);
+    uint64_t interval = static_cast<uint64_t>(std::chrono::nanoseconds(slot.options.flush_interval).count());
+    if(level < log_level::ERROR && now - last < interval)
+        return false;
+
+    // Only one of the threads writing an inline sink at the same time has to flush it
+    if(!slot.last_flush.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        return false;
+    slot.output->flush();
+    return true;
+}
+
+
+/**
+ * @brief Body of the thread of a sink that has its own queue.
+ * @param slot The sink.
+ *
+ * Works like writer_loop: lines are written from their slot, pending output is flushed once the
+ * flush interval has elapsed while the queue is empty, and the queue is drained on shutdown.
+ */
+void logging::sink_loop(sink_slot* slot)
+{
+    bool pending = false;
+    auto write_line = [this, slot, &pending](log_record& record)
+    {
+        char header[log_header_length];
+        formatHeader(header, record.time, record.level, record.get_fun_name(),
+                     time_precision.load(std::memory_order_relaxed));
+        pending = !write_to_sink(*slot, record.time, record.level, record.get_fun_name(), record.get_message(),
+                                 std::string_view(header, sizeof(header)));
+        record.release();
+    };
+    auto flush_sink = [slot, &pending](uint64_t now)
+    {
+        slot->output->flush();
+        slot->last_flush.store(now, std::memory_order_relaxed);
+        pending = false;
+    };
+
+    unsigned idle = 0;
+    for(;;)
+    {
+        bool written = slot->queue->try_consume(write_line);
+
+        if(slot->flush_requested.load(std::memory_order_acquire))
+        {
+            flush_sink(timestamp::now());
+            slot->flush_requested.store(false, std::memory_order_release);
+        }
+
+        if(written)
+        {
+            idle = 0;
+            continue;
+        }
+
+        if(slot->stop.load(std::memory_order_acquire))
+        {
+            while(slot->queue->try_consume(write_line))
+                ;
+            flush_sink(timestamp::now());
+            break;
+        }
+
+        if(pending)
+        {
+            uint64_t now = timestamp::now();
+            if(now - slot->last_flush.load(std::memory_order_relaxed) >=
+               static_cast<uint64_t>(std::chrono::nanoseconds(slot->options.flush_interval).count()))
+                flush_sink(now);
+        }
+
+        if(++idle < 64)
+            continue;
+        else if(idle < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+}
+
+
+/**
+ * @brief Holds a copy of a record taken off a thread queue, the copy owns its spill buffer.
+ */
+void logging::reorder_buffer::hold(const log_record& record)
+{
+    uint32_t slot;
+    if(free_slots.empty())
+    {
+        slot = static_cast<uint32_t>(records.size());
+        records.push_back(record);
+    }
+    else
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        records[slot] = record;
+    }
+    heap.push_back({record.time, taken++, slot});
+    std::push_heap(heap.begin(), heap.end(), std::greater<held_record>());
+}
+
+
+/**
+ * @brief Hands the oldest held record to write and frees its slot.
+ */
+template <typename F>
+void logging::reorder_buffer::write_oldest(const F& write)
+{
+    std::pop_heap(heap.begin(), heap.end(), std::greater<held_record>());
+    uint32_t slot = heap.back().slot;
+    heap.pop_back();
+    write(records[slot]);
+    free_slots.push_back(slot);
+}
+
+
+/**
+ * @brief Body of the background writer thread.
+ *
+ * Drains the queues of the logging threads in turns of a small batch each, which keeps the lines
+ * of different threads roughly in time order, and writes every record directly from its slot.
+ * With set_time_order the records are instead taken into the reorder buffer and written from
+ * there oldest first, once they are older than the reorder window.
+ * When every queue is empty the thread waits as set_writer_options says, by default it spins
+ * briefly, then yields and finally sleeps so an idle logger does not burn a core. On shutdown the
+ * remaining records are written before the thread exits.
+ */
+void logging::writer_loop()
+{
+    auto write_record = [this](log_record& record)
+    {
+        this->write_record(record);
+        record.release();
+    };
+    auto hold_record = [this](log_record& record)
+    {
+        reordered.hold(record);
+        record.spill = nullptr;         // the held copy gives it back
+    };
+
+    // A record that is held longer than the window can't be overtaken by one taken later
+    auto write_held = [&](bool all)
+    {
+        uint64_t window = reorder_window_ns.load(std::memory_order_relaxed);
+        size_t limit = reorder_records.load(std::memory_order_relaxed);
+        all = all || !window;
+        uint64_t now = reordered.size() && !all ? timestamp::now() : 0;
+        bool written = false;
+        while(reordered.size() && (all || reordered.size() > limit || reordered.oldest() + window <= now))
+        {
+            reordered.write_oldest(write_record);
+            written = true;
+        }
+        return written;
+    };
+
+    std::vector<std::shared_ptr<thread_queue>> queues;
+    uint64_t seen_version = 0;
+    auto drain = [&]()
+    {
+        if(queues_version.load(std::memory_order_acquire) != seen_version)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            seen_version = queues_version.load(std::memory_order_relaxed);
+            queues = thread_queues;
+        }
+
+        bool written = false;
+        bool abandoned = false;
+        bool reorder = reorder_window_ns.load(std::memory_order_relaxed) != 0;
+        for(const auto& pending : queues)
+        {
+            // The backlog is largest right before the writer gets to the queue
+            uint64_t depth = pending->records.size();
+            if(depth > queue_high_water.load(std::memory_order_relaxed))
+                queue_high_water.store(depth, std::memory_order_relaxed);
+
+            for(unsigned i = 0; i < 32 && (reorder ? pending->records.try_consume(hold_record)
+                                                   : pending->records.try_consume(write_record)); ++i)
+                written = true;
+            abandoned = abandoned || pending->abandoned.load(std::memory_order_acquire);
+        }
+        written = write_held(false) || written;
+
+        if(abandoned)
+        {
+            // The thread is gone, nothing can be pushed any more once the queue is empty
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            auto gone = [](const std::shared_ptr<thread_queue>& pending)
+            {
+                return pending->abandoned.load(std::memory_order_acquire) &&
+                       pending->records.popped() == pending->records.pushed();
+            };
+            // The queues are only freed with the old list, after the crash handler can't find them
+            std::vector<std::shared_ptr<thread_queue>> kept;
+            for(const auto& pending : thread_queues)
+                if(!gone(pending))
+                    kept.push_back(pending);
+            if(kept.size() != thread_queues.size())
+            {
+                thread_queues.swap(kept);
+                publish_crash_queues();
+                queues_version.fetch_add(1, std::memory_order_release);
+            }
+        }
+        return written;
+    };
+
+    // Blocks until a logging thread pushes a record, for at most timeout ns
+    auto block = [&](uint64_t timeout)
+    {
+        uint32_t seen = writer_wakeup.load(std::memory_order_relaxed);
+        writer_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // What was pushed before the flag could be seen is found here, what is pushed later wakes the writer
+        bool pending = drain() || flush_requested.load(std::memory_order_acquire) ||
+                       writer_stop.load(std::memory_order_acquire) || crashing.load(std::memory_order_acquire);
+        if(!pending)
+            wait_futex(writer_wakeup, seen, timeout);
+        writer_sleeping.store(false, std::memory_order_relaxed);
+    };
+
+    uint64_t applied_settings = 0;
+    unsigned idle = 0;
+    for(;;)
+    {
+        uint64_t settings = writer_settings_version.load(std::memory_order_acquire);
+        if(settings != applied_settings)
+        {
+            applied_settings = settings;
+            apply_writer_settings();
+        }
+
+        if(crashing.load(std::memory_order_acquire))
+        {
+            // drain_on_crash writes the rest, the process ends soon
+            writer_parked.store(true, std::memory_order_release);
+            for(;;)
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+
+        bool written = drain();
+
+        if(flush_requested.load(std::memory_order_acquire))
+        {
+            write_held(true);
+            flush_idle(true);
+            flush_requested.store(false, std::memory_order_release);
+        }
+
+        if(written)
+        {
+            idle = 0;
+            continue;
+        }
+
+        if(writer_stop.load(std::memory_order_acquire))
+        {
+            // Producers may have pushed between the pop and the stop check
+            while(drain())
+                ;
+            write_held(true);
+            break;
+        }
+
+        bool buffered = flush_idle(false);
+
+        switch (writer_wait.load(std::memory_order_relaxed))
+        {
+            case wait_strategy::spin:
+                continue;
+
+            case wait_strategy::sleep:
+                std::this_thread::sleep_for(std::chrono::nanoseconds(writer_sleep_ns.load(std::memory_order_relaxed)));
+                continue;
+
+            case wait_strategy::futex:
+                if(++idle >= 64)
+                {
+                    // Wake up in time for the flush interval and the reorder window
+                    uint64_t timeout = 1000000000;
+                    if(buffered)
+                        timeout = std::min(timeout, flush_interval_ns.load(std::memory_order_relaxed));
+                    if(reordered.size())
+                        timeout = std::min(timeout, reorder_window_ns.load(std::memory_order_relaxed));
+                    block(timeout);
+                    idle = 0;
+                }
+                continue;
+
+            case wait_strategy::backoff:
+            default:
+                break;
+        }
+
+        if(++idle < 64)
+            continue;
+        else if(idle < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+}
+
+
+/**
+ * @brief Applies the CPUs and the priority of set_writer_options to the calling thread, the writer.
+ * @details Without CPUs the writer runs where the process may. The nice value is relative to the
+ *          one of the process, and SCHED_IDLE is only undone if it is set.
+ */
+void logging::apply_writer_settings()
+{
+    writer_options options;
+    {
+        std::lock_guard<std::mutex> lock(writer_settings_mutex);
+        options = writer_settings;
+    }
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if(options.cpus.empty())
+        ::sched_getaffinity(::getpid(), sizeof(cpus), &cpus);
+    for(int cpu : options.cpus)
+        if(cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpus);
+    if(::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus) != 0)
+        std::cerr << "Can't pin the writer thread to its CPUs" << std::endl;
+
+    int policy;
+    sched_param param{};
+    if(::pthread_getschedparam(::pthread_self(), &policy, &param) == 0 &&
+       (options.idle_priority || policy == SCHED_IDLE) && policy != (options.idle_priority ? SCHED_IDLE : SCHED_OTHER))
+    {
+        param = sched_param{};
+        if(::pthread_setschedparam(::pthread_self(), options.idle_priority ? SCHED_IDLE : SCHED_OTHER, &param) != 0)
+            std::cerr << "Can't set the scheduling policy of the writer thread" << std::endl;
+    }
+
+    errno = 0;
+    int base = ::getpriority(PRIO_PROCESS, static_cast<id_t>(::getpid()));
+    int nice = std::max(-20, std::min(19, base + options.nice));
+    id_t thread = static_cast<id_t>(::syscall(SYS_gettid));
+    if(errno == 0 && ::getpriority(PRIO_PROCESS, thread) != nice && ::setpriority(PRIO_PROCESS, thread, nice) != 0)
+        std::cerr << "Can't set the nice value of the writer thread" << std::endl;
+#endif
+}
+
+
+/**
+ * @brief Wakes the writer thread if it blocks on writer_wakeup. Async signal safe.
+ */
+void logging::wake_writer()
+{
+    writer_wakeup.fetch_add(1, std::memory_order_relaxed);
+#if LOGGING_HAVE_FUTEX
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&writer_wakeup), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+
+/**
+ * @brief Set the log level for the logger.
+ * @param level The new log level.
+ * @details This function sets the log level for the logger. All log messages
+ *          with a level below the set log level will be discarded.
+ */
+void logging::set_log_level(log_level level)
+{
+     this->level.store(level, std::memory_order_relaxed);
+     update_floor();
+}
+
+
+/**
+ * @brief Keep the recent records below the log level in memory and write them only when an error is logged.
+ * @param records_per_thread The records each thread keeps, the oldest are overwritten. 0 turns the recorder off.
+ * @param capture_level The lowest level kept, the levels from it up to the log level are recorded.
+ * @param dump_records At most this many records, the newest of all the threads, are written before an error.
+ * @details A recorded message costs a copy into the thread's ring, no formatting and no I/O. When an ERROR or
+ *          FATAL line is logged the records of all the threads since the previous dump are merged by time and
+ *          written ahead of it, after a "Flight recorder" line with their count. A record keeps at most
+ *          flight_payload_size bytes: a longer message is cut, and deferred arguments that don't fit are left out.
+ */
+void logging::set_flight_recorder(size_t records_per_thread, log_level capture_level, size_t dump_records)
+{
+    flight_level.store(capture_level, std::memory_order_relaxed);
+    flight_dump.store(dump_records, std::memory_order_relaxed);
+    flight_capacity.store(records_per_thread, std::memory_order_relaxed);
+    update_floor();
+}
+
+
+void logging::update_floor()
+{
+    log_level kept = level.load(std::memory_order_relaxed);
+    log_level captured = flight_level.load(std::memory_order_relaxed);
+    if(flight_capacity.load(std::memory_order_relaxed) && captured < kept)
+        kept = captured;
+    floor_level.store(kept, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Select the clock the log timestamps are read from.
+ * @param source The new clock source, see timestamp::clock_source.
+ * @details The clock is shared by every logger in the process.
+ */
+void logging::set_clock_source(timestamp::clock_source source)
+{
+    timestamp::set_clock_source(source);
+}
+
+
+/**
+ * @brief Select whether the timestamps are written with milliseconds or microseconds.
+ * @param precision The new timestamp precision.
+ */
+void logging::set_timestamp_precision(timestamp::precision precision)
+{
+    time_precision.store(precision, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Enable or disable printing the log lines to the console.
+ * @param print Whether to print the log to the console.
+ */
+void logging::set_print_log(bool print)
+{
+    print_log.store(print, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Wait until every record queued so far has been written to the file and the sinks.
+ * @details In async mode this waits for the writer thread to write the records queued before
+ *          the call and flush the write combining buffer. Sync mode writes every line right away.
+ *          Every sink is flushed too, a sink with a queue by its own thread once it has written
+ *          the lines queued before. Lines suppressed by rate limited call sites are reported first.
+ */
+void logging::flush()
+{
+    for(rate_limit* limit = limited_sites.load(std::memory_order_acquire); limit; limit = limit->next)
+        report_suppressed(*limit->site, *limit);
+
+    bool started;
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        started = writer.joinable();
+    }
+    if(started)
+    {
+        std::vector<std::shared_ptr<thread_queue>> queues;
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            queues = thread_queues;
+        }
+
+        // The writer handles the request only after the record it is writing, so popped is enough
+        for(const auto& pending : queues)
+        {
+            size_t target = pending->records.pushed();
+            while(pending->records.popped() < target)
+                std::this_thread::yield();
+        }
+
+        flush_requested.store(true, std::memory_order_release);
+        notify_writer();
+        while(flush_requested.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    epoch::guard guard;
+    sink_list* list = sinks.load();
+    if(!list)
+        return;
+    for(sink_slot* slot : list->slots)
+    {
+        if(!slot->queue)
+        {
+            slot->output->flush();
+            continue;
+        }
+
+        size_t target = slot->queue->pushed();
+        while(slot->queue->popped() < target)
+            std::this_thread::yield();
+
+        slot->flush_requested.store(true, std::memory_order_release);
+        while(slot->flush_requested.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+}
+
+
+/**
+ * @brief Counts a suppressed line and makes the limit known to flush() the first time.
+ * @param at The call site of the limit.
+ */
+void logging::rate_limit::note_suppressed(const log_site& at)
+{
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    if(registered.load(std::memory_order_relaxed) || registered.exchange(true, std::memory_order_relaxed))
+        return;
+
+    site = &at;
+    next = limited_sites.load(std::memory_order_relaxed);
+    while(!limited_sites.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+
+/**
+ * @brief Adds a scope timer to timed_sites, once, so report_timers finds it.
+ */
+void logging::timer_stats::register_site(const log_site& at, std::string_view timer_name)
+{
+    if(registered.exchange(true, std::memory_order_relaxed))
+        return;
+
+    site = &at;
+    name = timer_name;
+    next = timed_sites.load(std::memory_order_relaxed);
+    while(!timed_sites.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+
+/**
+ * @brief Logs a summary of the durations every scope timer has recorded since the last report.
+ * @details The timers with the same name are added up and logged as one line at the level and
+ *          from the function of one of them. p50 and p99 are the upper bounds of their
+ *          power of two buckets, never more than the longest duration.
+ */
+void logging::report_timers()
+{
+    struct total
+    {
+        std::string_view name;
+        const log_site* site;
+        uint64_t buckets[histogram_buckets];
+        uint64_t count, sum, longest;
+    };
+    std::vector<total> totals;
+
+    for(timer_stats* timer = timed_sites.load(std::memory_order_acquire); timer; timer = timer->next)
+    {
+        auto found = std::find_if(totals.begin(), totals.end(),
+                                  [timer](const total& t) { return t.name == timer->name; });
+        if(found == totals.end())
+        {
+            totals.push_back(total{timer->name, timer->site, {}, 0, 0, 0});
+            found = totals.end() - 1;
+        }
+        for(size_t i = 0; i < histogram_buckets; ++i)
+        {
+            uint64_t n = timer->durations.buckets[i].exchange(0, std::memory_order_relaxed);
+            found->buckets[i] += n;
+            found->count += n;
+        }
+        found->sum += timer->durations.sum.exchange(0, std::memory_order_relaxed);
+        found->longest = std::max(found->longest, timer->longest.exchange(0, std::memory_order_relaxed));
+    }
+
+    for(const total& t : totals)
+    {
+        if(!t.count)
+            continue;
+        auto percentile = [&t](uint64_t per_mille)
+        {
+            uint64_t seen = 0;
+            for(size_t i = 0; i < histogram_buckets; ++i)
+            {
+                seen += t.buckets[i];
+                if(seen * 1000 >= t.count * per_mille)
+                    return std::min(uint64_t(1) << i, t.longest);
+            }
+            return t.longest;
+        };
+        add_log(*t.site, "{}: {} calls, avg {} ns, p50 {} ns, p99 {} ns, max {} ns", t.name, t.count,
+                t.sum / t.count, percentile(500), percentile(990), t.longest);
+    }
+}
+
+
+/**
+ * @brief Logs how many lines a rate limited call site has suppressed since its last report.
+ * @param site The call site.
+ * @param limit Its rate limit.
+ * @details Called by the rate limited LOG_* macros before the next line that gets through, and by flush().
+ */
+void logging::report_suppressed(const log_site& site, rate_limit& limit)
+{
+    uint64_t count = limit.suppressed.exchange(0, std::memory_order_relaxed);
+    if(count)
+        add_log(site, "suppressed {} messages from {}", count, site.function);
+}
+
+
+/**
+ * @brief Writes the queued records when the process crashes.
+ * @details Installs a handler for SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT and a std::terminate
+ *          handler. They write what the writer thread has buffered and every record still queued
+ *          to the console and the log file with plain write(2) calls, then the signal is raised
+ *          again with its default action, so the process still dumps core. A binary log file
+ *          is left as it is and the records go to stderr as text instead. Sinks added with
+ *          add_sink are not written. This is best effort: the crash may have left the logger
+ *          itself in an inconsistent state.
+ */
+void logging::install_crash_handler()
+{
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    crash_logger.store(this);
+
+    struct sigaction action{};
+    action.sa_handler = &logging::crash_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    for(int signal_number : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        ::sigaction(signal_number, &action, nullptr);
+
+    std::terminate_handler previous = std::set_terminate(&logging::crash_terminate);
+    if(previous != &logging::crash_terminate)
+        previous_terminate = previous;
+}
+
+
+/**
+ * @brief Signal handler installed by install_crash_handler.
+ * @param signal_number The fatal signal.
+ */
+void logging::crash_signal(int signal_number)
+{
+    logging* target = crash_logger.load();
+    if(target)
+        target->drain_on_crash();
+
+    // SA_RESETHAND restored the default action, it ends the process once the handler returns
+    ::raise(signal_number);
+}
+
+
+/**
+ * @brief std::terminate handler installed by install_crash_handler.
+ */
+void logging::crash_terminate()
+{
+    logging* target = crash_logger.load();
+    if(target)
+        target->drain_on_crash();
+
+    if(previous_terminate)
+        previous_terminate();
+    std::abort();
+}
+
+
+/**
+ * @brief Writes the buffered and queued records with async-signal-safe calls only.
+ *
+ * Runs once. A thread that crashes while another one is draining waits up to a second for it.
+ * The writer thread is parked first, so the lines keep their order. Takes no lock and no epoch
+ * guard, the crashed thread may hold either: the queues are found through crash_queues and the
+ * times are written without localtime_r. Deferred records are rendered into a static buffer and
+ * cut at its size.
+ */
+void logging::drain_on_crash()
+{
+    static std::atomic<int> state{0};       // 0 idle, 1 draining, 2 done
+    int idle = 0;
+    if(!state.compare_exchange_strong(idle, 1))
+    {
+        for(int i = 0; i < 1000 && state.load() != 2; ++i)
+        {
+            timespec pause{0, 1000000};
+            ::nanosleep(&pause, nullptr);
+        }
+        return;
+    }
+
+    // Wait up to 100 ms for the writer to finish its record, unless it is the thread that crashed
+    crashing.store(true, std::memory_order_release);
+    wake_writer();
+    if(writer.joinable() && writer.get_id() != std::this_thread::get_id())
+    {
+        for(int i = 0; i < 100 && !writer_parked.load(std::memory_order_acquire); ++i)
+        {
+            timespec pause{0, 1000000};
+            ::nanosleep(&pause, nullptr);
+        }
+    }
+
+    bool console = print_log.load(std::memory_order_relaxed);
+    file_sink* current = sink.load();
+    bool text_file = current && current->format == file_format::text;
+
+    // What the writer thread has collected comes first: the buffers handed to io_uring, then the
+    // write combining buffer
+    if(current && current->uring)
+        current->uring->drain_on_crash();
+    if(current && current->used)
+    {
+        iovec part = {current->buffer, current->used};
+        current->used = 0;
+        writev_fully(current->fd, &part, 1);
+    }
+
+    auto write_line = [&](uint64_t time, log_level level, std::string_view fun_name, const char* format,
+                          std::string_view message)
+    {
+        static char text[4096];
+        if(format)
+            message = std::string_view(text, renderFormat(text, sizeof(text), format, message));
+
+        static const char newline = '\n';
+        char header[log_header_length];
+        formatHeader(header, time, level, fun_name, time_precision.load(std::memory_order_relaxed), true);
+        auto line = [&](iovec* parts)
+        {
+            parts[0] = {header, sizeof(header)};
+            parts[1] = {const_cast<char*>(message.data()), message.size()};
+            parts[2] = {const_cast<char*>(&newline), 1};
+        };
+
+        iovec parts[3];
+        if(console)
+        {
+            line(parts);
+            writev_fully(STDOUT_FILENO, parts, 3);
+        }
+        line(parts);
+        if(current && text_file && current->mapped)
+        {
+            // A mapped file never rolls over here, what doesn't fit goes to stderr
+            if(!current->mapped->write_on_crash(parts, 3) && !console)
+            {
+                line(parts);
+                writev_fully(STDERR_FILENO, parts, 3);
+            }
+        }
+        else if(current && text_file)
+            current->write_direct(parts, 3);
+        else if(current && !console)
+            writev_fully(STDERR_FILENO, parts, 3);
+    };
+    auto write_record = [&](log_record& record)
+    {
+        if(record.format != batch_format)
+        {
+            write_line(record.time, record.level, record.get_fun_name(), record.format, record.get_message());
+            return;
+        }
+        for_each_entry(record.get_message(),
+                       [&](log_level level, std::string_view fun_name, const char* format, std::string_view payload)
+                       {
+                           write_line(record.time, level, fun_name, format, payload);
+                       });
+    };
+
+    // The spill buffers of these records are not given back, the process is about to end.
+    // The records held to put them in time order were taken first, so they go first
+    while(reordered.size())
+        reordered.write_oldest(write_record);
+    for(auto& slot : crash_queues)
+    {
+        thread_queue* pending = slot.load(std::memory_order_acquire);
+        if(pending)
+            while(pending->records.try_consume(write_record))
+                ;
+    }
+
+    state.store(2);
+}
+
+
+/**
+ * @brief Copies thread_queues to crash_queues, which drain_on_crash reads without queues_mutex.
+ * @details Called with queues_mutex held. A queue keeps its slot while it is in thread_queues,
+ *          new ones are appended, so a handler reading the slots meanwhile finds every queue
+ *          that is not being removed. The threads after the first crash_queue_slots are left out.
+ */
+void logging::publish_crash_queues()
+{
+    size_t count = std::min(thread_queues.size(), crash_queue_slots);
+    for(size_t i = 0; i < crash_queue_slots; ++i)
+        crash_queues[i].store(i < count ? thread_queues[i].get() : nullptr, std::memory_order_release);
+}
+
+
+/**
+ * @brief Adds an output the log lines are written to, in addition to the console and the log file.
+ * @param output The sink, see log_sinks.hpp for the ones that come with the logger.
+ * @param options Its minimum level, queue and flush interval.
+ * @details The level set with set_log_level still applies first. A sink with a queue_capacity gets
+ *          its own queue and thread: the logging threads and the writer thread only copy the line
+ *          into that queue, so a slow sink like a blocked pipe can't hold up anything else. What
+ *          happens when its queue is full is decided by options.policy, dropped lines are counted
+ *          in dropped_count(). A sink without a queue is written inline and must be thread-safe.
+ */
+void logging::add_sink(std::shared_ptr<log_sink> output, const sink_options& options)
+{
+    if(!output)
+        return;
+
+    sink_slot* slot = new sink_slot;
+    slot->output = std::move(output);
+    slot->options = options;
+    if(options.queue_capacity)
+    {
+        slot->queue.reset(new ring_buffer<log_record>(options.queue_capacity));
+        slot->thread = std::thread(&logging::sink_loop, this, slot);
+    }
+
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    sink_list* old = sinks.load();
+    sink_list* next = new sink_list;
+    if(old)
+        next->slots = old->slots;
+    next->slots.push_back(slot);
+    sinks.store(next);
+    epoch::synchronize();
+    delete old;
+}
+
+
+/**
+ * @brief Adds an output that gets every line right away, see add_sink(output, options).
+ * @param output The sink.
+ */
+void logging::add_sink(std::shared_ptr<log_sink> output)
+{
+    add_sink(std::move(output), sink_options());
+}
+
+
+/**
+ * @brief Removes an output added with add_sink.
+ * @param output The sink.
+ * @details Lines still in the queue of the sink are written and the sink is flushed before
+ *          this returns. The logger drops its reference to the sink.
+ */
+void logging::remove_sink(const std::shared_ptr<log_sink>& output)
+{
+    sink_slot* removed = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        sink_list* old = sinks.load();
+        if(!old)
+            return;
+
+        sink_list* next = new sink_list;
+        for(sink_slot* slot : old->slots)
+        {
+            if(!removed && slot->output == output)
+                removed = slot;
+            else
+                next->slots.push_back(slot);
+        }
+        if(!removed)
+        {
+            delete next;
+            return;
+        }
+        if(next->slots.empty())
+        {
+            delete next;
+            next = nullptr;
+        }
+
+        sinks.store(next);
+        epoch::synchronize();
+        delete old;
+    }
+    stop_sink(removed);
+}
+
+
+/**
+ * @brief Writes what is left in the queue of a sink, stops its thread, flushes and frees it.
+ * @param slot The sink. No thread may still be writing to it.
+ */
+void logging::stop_sink(sink_slot* slot)
+{
+    if(slot->thread.joinable())
+    {
+        slot->stop.store(true, std::memory_order_release);
+        slot->thread.join();
+    }
+    else
+    {
+        slot->output->flush();
+    }
+    delete slot;
+}
+
+
+/**
+ * @brief Switch between writing on the calling thread and writing from a background thread.
+ * @param new_mode The new mode.
+ * @details Switching to async mode the first time starts the
+ *          writer thread. The writer keeps running until the logger is destroyed, so
+ *          records queued while switching back to sync mode are still written.
+ *          The binary file format and the file index are always written by the writer
+ *          thread, so the logger stays in async mode while either is selected.
+ */
+void logging::set_mode(mode new_mode)
+{
+    if(file_fmt.load(std::memory_order_relaxed) == file_format::binary || index_block.load(std::memory_order_relaxed))
+        new_mode = mode::async;
+
+    if(new_mode == mode::async)
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        start_writer();
+    }
+    log_mode.store(new_mode, std::memory_order_release);
+}
+
+
+/**
+ * @brief Select whether the log file is written as text lines or in binary format.
+ * @param format The new file format.
+ * @details Binary records are encoded by the writer thread, which keeps the interning
+ *          state, so selecting binary switches the logger to async mode. A file holds one
+ *          format: the current file is rotated, without compressing it, and the records
+ *          written from then on go to a new file in the new format. A rotated file that
+ *          got nothing is removed. open_sink also moves an existing file in the other
+ *          format aside before it appends to it.
+ */
+void logging::set_file_format(file_format format)
+{
+    if(file_fmt.exchange(format, std::memory_order_relaxed) == format)
+        return;
+    if(format == file_format::binary)
+        set_mode(mode::async);
+
+    rotation_policy policy;
+    {
+        std::lock_guard<std::mutex> lock(rotation_mutex);
+        policy = rotation;
+    }
+    policy.compress = compression::none;
+    rotate(policy);
+}
+
+
+/**
+ * @brief Select the layout of the lines written to the console and to a text log file.
+ * @param layout Text, JSON lines or logfmt, see line_format.
+ * @details The fields of log_args::kv become JSON members or logfmt pairs, so the lines can be
+ *          read without parsing the text format. The message and the fields are escaped while
+ *          they are rendered. Sinks and the crash handler still get text lines.
+ */
+void logging::set_line_format(line_format layout)
+{
+    line_fmt.store(layout, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Enable or disable sanitizing the messages of text lines.
+ * @param enable Whether newlines, control characters and invalid UTF-8 are escaped, see sanitizeText.
+ * @details Keeps a message from breaking the one line per record framing of the file or sending
+ *          escape sequences to the terminal. A message without such bytes is found clean by a
+ *          vector scan and written as it is. JSON and logfmt lines are always escaped.
+ */
+void logging::set_sanitize(bool enable)
+{
+    sanitize.store(enable, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Select how the log file is written and reopen it with the new backend.
+ * @param new_backend The new file backend.
+ * @param new_segment_size The size preallocated and mapped per segment file with the mmap backend.
+ * @details With the mmap backend every thread copies its line straight into a shared mapping of the
+ *          file, so logging needs no system calls and the last lines survive a crash of the process
+ *          in the page cache. A crashed process leaves the preallocated tail of the segment as zero
+ *          bytes, a normal close cuts it off. With the uring backend the writer thread submits its
+ *          write combining buffer to an io_uring and goes on with the next one, see uring_writer. It
+ *          needs a file buffer, and falls back to the write backend on kernels without io_uring.
+ */
+void logging::set_file_backend(file_backend new_backend, size_t new_segment_size)
+{
+    std::string current;
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        backend.store(new_backend, std::memory_order_relaxed);
+        segment_size.store(new_segment_size, std::memory_order_relaxed);
+        current = filename;
+    }
+    if(!current.empty())
+        change_log_file(current);
+}
+
+
+/**
+ * @brief Configure the write combining buffer the writer thread uses for the log file.
+ * @param buffer_size The buffer size in bytes, 0 writes every record straight to the file.
+ * @param flush_interval The longest time a record may wait in the buffer.
+ * @details Only async mode buffers, in sync mode every line is written by its own thread.
+ *          The buffer is always flushed right away after an ERROR or FATAL record.
+ */
+void logging::set_file_buffer(size_t buffer_size, std::chrono::milliseconds flush_interval)
+{
+    file_buffer_size.store(buffer_size, std::memory_order_relaxed);
+    flush_interval_ns.store(std::chrono::nanoseconds(flush_interval).count(), std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Keep a sparse index of the log file next to it, for logquery.
+ * @param block_size The bytes of lines per index entry, 0 stops indexing.
+ * @details The index of app.log is app.log.idx, see log_index.hpp. Every entry holds the offset
+ *          and length of a block of lines, their earliest and latest time and the levels they
+ *          have, so a query reads only the blocks it needs. The writer thread keeps the index,
+ *          so the logger stays in async mode while it is on. The file is reopened to start it.
+ *          Only text files written with the write or uring backend are indexed. The index is
+ *          rotated with the file and deleted when the rotated file is compressed.
+ */
+void logging::set_file_index(size_t block_size)
+{
+    std::string current;
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        index_block.store(block_size, std::memory_order_relaxed);
+        current = filename;
+    }
+    if(block_size)
+        set_mode(mode::async);
+    if(!current.empty())
+        change_log_file(current);
+}
+
+
+/**
+ * @brief Start the writer thread unless already running.
+ * @details The caller must hold instance_mutex or be the constructor. The queues are
+ *          allocated by the logging threads the first time they log in async mode.
+ */
+void logging::start_writer()
+{
+    if(!writer.joinable())
+        writer = std::thread(&logging::writer_loop, this);
+}
+
+
+/**
+ * @brief Set what async mode does with a record when the queue is full.
+ * @param new_policy The new overflow policy.
+ */
+void logging::set_overflow_policy(overflow_policy new_policy)
+{
+    policy.store(new_policy, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Set the number of records the async queue of a logging thread holds.
+ * @param capacity The capacity, rounded up to a power of two.
+ * @details Applies to the threads that log in async mode for the first time afterwards. A record
+ *          takes about 256 bytes; a larger queue absorbs longer bursts before the overflow
+ *          policy applies.
+ */
+void logging::set_queue_capacity(size_t capacity)
+{
+    queue_capacity.store(capacity, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Write the async records of all threads in time order instead of one queue after another.
+ * @param reorder_window How long the writer holds a record before writing it, 0 turns reordering off.
+ * @param max_held The most records held, beyond that the oldest are written before their window ends.
+ * @details The logging threads keep pushing to their own queues without a lock. The writer takes
+ *          the records into a min-heap on the time taken when they were logged and writes the
+ *          oldest once it is older than the window, so lines from different threads end up in
+ *          order as long as none waits in its queue longer than the window. flush() and shutdown
+ *          write everything held. Lines written in sync mode meanwhile are not reordered.
+ */
+void logging::set_time_order(std::chrono::microseconds reorder_window, size_t max_held)
+{
+    reorder_records.store(max_held, std::memory_order_relaxed);
+    reorder_window_ns.store(static_cast<uint64_t>(std::chrono::nanoseconds(reorder_window).count()),
+                            std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Summarize the durations of the LOG_SCOPE_TIMER scopes periodically instead of logging every scope.
+ * @param interval How often the summaries are logged, 0 logs a line per scope again.
+ * @details Every call site collects its durations in a log2 histogram of its own. The rotation
+ *          thread logs one line per timer name every interval with the number of calls, the average,
+ *          p50, p99 and the longest duration, and starts the next interval from zero. What is left
+ *          is reported when aggregation is turned off and when the logger is destroyed.
+ */
+void logging::set_timer_aggregation(std::chrono::milliseconds interval)
+{
+    bool was_on;
+    {
+        std::lock_guard<std::mutex> lock(rotation_mutex);
+        timer_interval = static_cast<uint64_t>(std::chrono::nanoseconds(interval).count());
+        next_timer_report = timestamp::now() + timer_interval;
+        was_on = aggregate_timers.exchange(timer_interval != 0, std::memory_order_relaxed);
+        if(timer_interval)
+            start_rotator();
+        rotation_wakeup.notify_one();
+    }
+    if(was_on && !timer_interval)
+        report_timers();
+}
+
+
+/**
+ * @brief Place the writer thread and choose how it waits for records.
+ * @param options Its CPUs, priority, wait strategy and the NUMA placement of the queues.
+ * @details The writer applies the CPUs and the priority to itself the next time it looks at the
+ *          queues, or when it starts. wait_strategy::spin keeps a core busy for the lowest latency,
+ *          futex blocks once the writer has found nothing 64 times in a row and makes the logging
+ *          threads pay a fence per record to see whether they must wake it, sleep looks every
+ *          sleep_interval. With numa_local_queues the pages of a thread's queue are moved to the node
+ *          the thread runs on when the queue is made, since the allocator may hand out memory first
+ *          touched on another node. Pin the writer to CPUs of the node most logging threads run on.
+ */
+void logging::set_writer_options(const writer_options& options)
+{
+    {
+        std::lock_guard<std::mutex> lock(writer_settings_mutex);
+        writer_settings = options;
+    }
+    writer_sleep_ns.store(static_cast<uint64_t>(std::chrono::nanoseconds(options.sleep_interval).count()),
+                          std::memory_order_relaxed);
+    numa_local.store(options.numa_local_queues, std::memory_order_relaxed);
+    writer_wait.store(options.wait, std::memory_order_relaxed);
+    writer_settings_version.fetch_add(1, std::memory_order_release);
+    wake_writer();
+}
+
+
+/**
+ * @brief Get the number of records discarded by the drop_newest and drop_oldest policies.
+ * @return The number of dropped records.
+ */
+uint64_t logging::dropped_count() const
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Counts a duration in its log2 bucket.
+ * @param ns The duration in ns.
+ */
+void logging::histogram::record(uint64_t ns)
+{
+    size_t bucket = ns ? 64 - static_cast<size_t>(__builtin_clzll(ns)) : 0;
+    buckets[std::min(bucket, histogram_buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+}
+
+
+/**
+ * @brief Get the counters of the logger itself.
+ * @return The counters, added up over every thread that has logged.
+ * @details The logging threads and the writer thread count into counters of their own, so
+ *          counting costs them no contended cache line. This adds them up, the result is
+ *          consistent per counter but not across counters. See set_stats_interval for rates.
+ */
+logging::stats logging::get_stats() const
+{
+    stats result;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        result = retired_stats;
+        for(const auto& counters : thread_counters)
+        {
+            for(size_t i = 0; i < level_count; ++i)
+                result.records[i] += counters->records[i].load(std::memory_order_relaxed);
+            result.bytes_written += counters->bytes.load(std::memory_order_relaxed);
+            result.clock_samples += counters->clock_samples.load(std::memory_order_relaxed);
+            result.clock_ns += counters->clock_ns.load(std::memory_order_relaxed);
+            result.format_samples += counters->format_samples.load(std::memory_order_relaxed);
+            result.format_ns += counters->format_ns.load(std::memory_order_relaxed);
+        }
+    }
+
+    result.time = timestamp::now();
+    result.dropped = dropped.load(std::memory_order_relaxed);
+    result.queue_high_water = queue_high_water.load(std::memory_order_relaxed);
+    for(size_t i = 0; i < histogram_buckets; ++i)
+        result.flush_latency[i] = flush_latency.buckets[i].load(std::memory_order_relaxed);
+    result.flush_ns = flush_latency.sum.load(std::memory_order_relaxed);
+    return result;
+}
+
+
+/**
+ * @brief Hands the counters of get_stats to a callback in the Prometheus text format.
+ * @param callback Gets the text, e.g. to answer a scrape request.
+ */
+void logging::export_stats(const std::function<void(std::string_view text)>& callback) const
+{
+    callback(formatPrometheus(get_stats()));
+}
+
+
+/**
+ * @brief Report the counters of the logger periodically.
+ * @param interval The time between two reports, 0 stops them. They are checked about every 100 ms.
+ * @param callback Gets the counters in the Prometheus text format. Without one each report is
+ *        logged as a line with the rates since the last report.
+ * @details The reports are made by the background thread that also rotates the log file.
+ */
+void logging::set_stats_interval(std::chrono::milliseconds interval,
+                                 std::function<void(std::string_view text)> callback)
+{
+    std::lock_guard<std::mutex> lock(rotation_mutex);
+    stats_interval = static_cast<uint64_t>(std::chrono::nanoseconds(interval).count());
+    stats_callback = std::move(callback);
+    next_stats = timestamp::now() + stats_interval;
+    if(stats_interval)
+        start_rotator();
+}
+
+
+/**
+ * @brief Makes one report of the counters, see set_stats_interval.
+ * @param callback The callback, logs a line if it is empty.
+ */
+void logging::report_stats(const std::function<void(std::string_view)>& callback)
+{
+    if(callback)
+    {
+        export_stats(callback);
+        return;
+    }
+
+    stats current = get_stats();
+    double seconds = static_cast<double>(current.time - last_stats.time) / 1e9;
+    if(last_stats.time == 0 || seconds <= 0)
+    {
+        last_stats = current;
+        return;
+    }
+
+    auto rate = [seconds](uint64_t now, uint64_t before)
+    {
+        return static_cast<uint64_t>(static_cast<double>(now - before) / seconds);
+    };
+    auto average = [](uint64_t ns, uint64_t samples) { return samples ? ns / samples : 0; };
+
+    uint64_t records = 0, flushes = 0;
+    for(size_t i = 0; i < level_count; ++i)
+        records += current.records[i] - last_stats.records[i];
+    for(size_t i = 0; i < histogram_buckets; ++i)
+        flushes += current.flush_latency[i] - last_stats.flush_latency[i];
+
+    add_log(log_level::UNKNOWN, "stats",
+            "{} records/s (DEBUG {} INFO {} WARNING {} ERROR {} FATAL {}), {} bytes/s, {} dropped, "
+            "queue high water {}, {} flushes avg {} ns, clock avg {} ns, format avg {} ns",
+            static_cast<uint64_t>(static_cast<double>(records) / seconds),
+            rate(current.records[0], last_stats.records[0]), rate(current.records[1], last_stats.records[1]),
+            rate(current.records[2], last_stats.records[2]), rate(current.records[3], last_stats.records[3]),
+            rate(current.records[4], last_stats.records[4]),
+            rate(current.bytes_written, last_stats.bytes_written), current.dropped - last_stats.dropped,
+            current.queue_high_water, flushes, average(current.flush_ns - last_stats.flush_ns, flushes),
+            average(current.clock_ns - last_stats.clock_ns, current.clock_samples - last_stats.clock_samples),
+            average(current.format_ns - last_stats.format_ns, current.format_samples - last_stats.format_samples));
+    last_stats = current;
+}
+
+
+/**
+ * @brief Get the global logging instance.
+ * @param filename The filename to log to.
+ * @param print_log Whether to print the log to the console.
+ * @param log_mode Whether lines are written on the calling thread or by a background writer.
+ * @return The global logging instance.
+ */
+logging* logging::get_instance(std::string filename, bool print_log, mode log_mode) {
+    logging* current = existing_instance();
+    if (current)
+        return current;
+
+    std::lock_guard<std::mutex> lock(instance_mutex); // Ensure thread safety
+    if (!instance) {
+        instance.reset(new logging(filename, print_log, log_mode));
+        shared_instance.store(instance.get(), std::memory_order_release);
+    }
+    return instance.get();
+}
+
+
+/**
+ * @brief Get the channel with the given name, making it on its first use.
+ * @param name The name, added to the lines of the channel as logger=name.
+ * @return The channel, it writes through the default logger logger::log.
+ * @details Looking a channel up takes no lock: the map is read under an epoch::guard and only
+ *          replaced as a whole when a channel is added. A new channel starts at the level
+ *          of the default logger.
+ */
+logging::channel& logging::get(std::string_view name)
+{
+    {
+        epoch::guard guard;
+        channel_map* current = channels.load();
+        if(current)
+        {
+            auto found = current->by_name.find(name);
+            if(found != current->by_name.end())
+                return *found->second;
+        }
+    }
+
+    logging* backend = logger::log.get();
+    std::lock_guard<std::mutex> lock(channels_mutex);
+    channel_map* current = channels.load();
+    if(current)
+    {
+        auto found = current->by_name.find(name);
+        if(found != current->by_name.end())
+            return *found->second;
+    }
+
+    channel* made = new channel(std::string(name), backend);
+    channel_map* next = current ? new channel_map(*current) : new channel_map;
+    next->by_name.emplace(made->name(), made);
+    channels.store(next);
+    epoch::synchronize();
+    delete current;
+    return *made;
+}
+
+
+namespace {
+    std::mutex settings_mutex;
+    logger::settings& pending_settings()
+    {
+        static logger::settings options;
+        return options;
+    }
+}
+
+
+/**
+ * @brief Set how the default logger is made, before its first use.
+ * @param options The file, console output, mode and a setup callback for the rest, e.g. sinks.
+ * @return false if the logger has already been made, the settings are then ignored.
+ */
+bool logger::configure(settings options)
+{
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    if(logging::existing_instance())
+        return false;
+    pending_settings() = std::move(options);
+    return true;
+}
+
+
+/**
+ * @brief Makes the default logger with the settings of configure, on the first use of logger::log.
+ * @return The logger.
+ */
+logging* logger::handle::create()
+{
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        settings options;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            options = pending_settings();
+        }
+        logging* made = logging::get_instance(options.filename, options.print_log, options.log_mode);
+        if(options.setup)
+            options.setup(*made);
+    });
+    return logging::existing_instance();
+}
+
+
+/**
+ * @brief Changes the log file used by the logger.
+ * @param new_filename The new filename to log to.
+ *
+ * If a filename is provided, the log file will be opened in append mode.
+ * If the file cannot be opened, the logger will fall back to printing to the console
+ * and a message will be printed to the standard error stream. Other threads may keep
+ * logging while the file is changed: the new file is opened before it is swapped in,
+ * and the old file is closed once every thread that was writing to it has finished.
+ * Reopening the current file closes it first, lines logged meanwhile are not written to it.
+ */
+void logging::change_log_file(const std::string& new_filename)
+{
+    std::lock_guard<std::mutex> lock(instance_mutex); // Ensure thread safety
+
+    // Reopening the same file: the old one must be flushed and cut back before it is opened again
+    file_sink* current = sink.load();
+    std::string resolved = new_filename;
+    if(resolved.find_last_of('.') == std::string::npos)
+        resolved += ".log";
+    if(current && current->filename == resolved)
+    {
+        sink.store(nullptr);
+        epoch::synchronize();
+        delete current;
+    }
+
+    // Open the new log file first, so logging continues into the old one meanwhile
+    filename = new_filename;
+    file_sink* next = nullptr;
+    if(!filename.empty())
+    {
+        next = open_sink(filename);
+        if(!next)
+            print_log = false;
+    }
+
+    swap_sink(next);
+}
+
+
+/**
+ * @brief Publishes a new log file, then waits until no thread can still be writing to the old one and closes it.
+ * @param next The new log file, may be nullptr.
+ * @details The caller must hold instance_mutex.
+ */
+void logging::swap_sink(file_sink* next)
+{
+    file_sink* old = sink.exchange(next);
+    epoch::synchronize();
+    delete old;
+}
+
+
+/**
+ * @brief Set the size and time based rotation of the log file.
+ * @param policy The new rotation policy.
+ * @details Rotation runs on a low priority background thread which is started the first time
+ *          a policy is set. It checks the file about every 100 ms, so the file can grow a little
+ *          beyond max_bytes. The file is renamed to <stem>.<YYYYmmdd-HHMMSS>.<ext>, a new file is
+ *          opened and swapped in without stopping the logging threads, the rotated file is then
+ *          compressed and the oldest rotated files beyond keep_files are deleted.
+ */
+void logging::set_rotation(const rotation_policy& policy)
+{
+    std::lock_guard<std::mutex> lock(rotation_mutex);
+    rotation = policy;
+    next_rotation = next_rotation_time(timestamp::now(), policy.interval);
+    start_rotator();
+    rotation_wakeup.notify_one();
+}
+
+
+/**
+ * @brief Starts the rotation thread if it is not running. The caller must hold rotation_mutex.
+ */
+void logging::start_rotator()
+{
+    if(!rotator.joinable())
+        rotator = std::thread(&logging::rotation_loop, this);
+}
+
+
+/**
+ * @brief Body of the rotation thread, which also makes the reports of set_stats_interval.
+ */
+void logging::rotation_loop()
+{
+#ifdef __linux__
+    // Rotation and compression must never compete with the logging threads
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+
+    std::unique_lock<std::mutex> lock(rotation_mutex);
+    while(!rotation_stop)
+    {
+        rotation_wakeup.wait_for(lock, std::chrono::milliseconds(100));
+        if(rotation_stop)
+            break;
+
+        uint64_t now = timestamp::now();
+        if(stats_interval && now >= next_stats)
+        {
+            next_stats = now + stats_interval;
+            std::function<void(std::string_view)> callback = stats_callback;
+            lock.unlock();
+            report_stats(callback);
+            lock.lock();
+        }
+
+        if(timer_interval && now >= next_timer_report)
+        {
+            next_timer_report = now + timer_interval;
+            lock.unlock();
+            report_timers();
+            lock.lock();
+        }
+
+        rotation_policy policy = rotation;
+        bool due = policy.interval != rotation_interval::none && now >= next_rotation;
+        if(!due && policy.max_bytes)
+        {
+            epoch::guard guard;
+            file_sink* current = sink.load();
+            due = current && current->size() > policy.max_bytes;
+        }
+        if(!due)
+            continue;
+
+        next_rotation = next_rotation_time(now, policy.interval);
+        lock.unlock();
+        rotate(policy);
+        lock.lock();
+    }
 }
-std::mutex logging::instance_mutex;
 
 
 /**
- * @brief Constructs a new logging instance.
- * @param filename The filename to log to. If empty, logs to the console only.
- * @param print_log Whether to print the log to the console.
- *
- *If a filename is provided, the log file will be opened in append mode.
- *If the file cannot be opened, the logger will fall back to printing to the console
- *and a message will be printed to the standard error stream.
- *
- *The constructor also logs a message with the log level UNKNOWN to mark the start
- *of a new logger.
+ * @brief Rotates the log file now.
+ * @param policy The rotation policy to apply to the rotated file.
+ * @details Does nothing without a log file. A rotated file nothing was written to is removed.
  */
-logging::logging(std::string filename , bool print_log) :filename(filename) , print_log(print_log) 
+void logging::rotate(const rotation_policy& policy)
 {
-    if(!filename.empty())
+    std::string rotated, stem, ext;
+    unsigned segments = 0;              // the <file>.1, <file>.2, ... of the mmap backend
     {
-        if(filename.find_last_of('.') == std::string::npos)
-            filename += ".log";
-        log_file.open(filename, std::ios::app);
-        if (!log_file.is_open())
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        file_sink* current = sink.load();
+        if(!current)
+            return;
+
+        rotated = rotated_name(current->filename, stem, ext);
+
+        // Threads keep writing to the renamed file until the new one is swapped in, nothing is lost
+        if(::rename(current->filename.c_str(), rotated.c_str()) != 0)
         {
-            std::cerr << "Can't open log file " << filename << std::endl;
-            print_log = false;
+            std::cerr << "Can't rotate log file " << current->filename << std::endl;
+            return;
         }
+        if(current->index)
+            ::rename((current->filename + log_index::suffix).c_str(), (rotated + log_index::suffix).c_str());
+        std::string filename = current->filename;
+        bool mapped = current->mapped != nullptr;
+        file_sink* next = open_sink(filename);
+        if(!next)
+            return;
+        swap_sink(next);
+
+        // The old segments are closed now, they follow the file as <rotated>.1, <rotated>.2, ...
+        while(mapped && ::rename((filename + "." + std::to_string(segments + 1)).c_str(),
+                                 (rotated + "." + std::to_string(segments + 1)).c_str()) == 0)
+            ++segments;
     }
 
-    add_log(log_level::UNKNOWN , "New logger" , "============================================");
+    // Nothing was written to the old file, e.g. after set_file_format on an empty file
+    struct stat info;
+    if(!segments && ::stat(rotated.c_str(), &info) == 0 && info.st_size == 0)
+    {
+        ::unlink(rotated.c_str());
+        ::unlink((rotated + log_index::suffix).c_str());
+        return;
+    }
+
+    // The offsets of the index are those of the uncompressed file
+    if(policy.compress == compression::gzip && compress_file(rotated))
+        ::unlink((rotated + log_index::suffix).c_str());
+    for(unsigned n = 1; policy.compress == compression::gzip && n <= segments; ++n)
+        compress_file(rotated + "." + std::to_string(n));
+    if(policy.keep_files)
+        prune_rotated(stem, ext, policy.keep_files);
 }
 
 
 /**
- * @brief Logs a message with a given log level, function name and message.
- *
- * The logged message will have the format "[time] [level] [function name] [message]". The time is the current time in the format
- * "%Y-%m-%d %H:%M:%S". The level is the string representation of the given log level. The function name is the given function name.
- * The message is the given message.
+ * @brief Picks the name a log file is rotated to, <stem>.<YYYYmmdd-HHMMSS>[-n].<ext>. The names sort by age.
+ * @param filename The log file.
+ * @param stem Set to the path without the extension.
+ * @param ext Set to the extension, including the dot. May be empty.
+ * @return A name no file or compressed file has yet.
+ */
+std::string logging::rotated_name(const std::string& filename, std::string& stem, std::string& ext)
+{
+    std::time_t now = std::time(nullptr);
+    std::tm time_info;
+    localtime_r(&now, &time_info);
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &time_info);
+
+    size_t slash = filename.find_last_of('/');
+    size_t dot = filename.find_last_of('.');
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = filename.size();
+    stem = filename.substr(0, dot);
+    ext = filename.substr(dot);
+    std::string rotated = stem + "." + stamp + ext;
+    for(int n = 1; ::access(rotated.c_str(), F_OK) == 0 || ::access((rotated + ".gz").c_str(), F_OK) == 0; ++n)
+        rotated = stem + "." + stamp + "-" + std::to_string(n) + ext;
+    return rotated;
+}
+
+
+/**
+ * @brief Computes when the next time based rotation is due.
+ * @param now The current time, in ns since epoch.
+ * @param interval The rotation interval.
+ * @return The start of the next local hour or day, in ns since epoch. UINT64_MAX if there is none.
+ */
+uint64_t logging::next_rotation_time(uint64_t now, rotation_interval interval)
+{
+    if(interval == rotation_interval::none)
+        return UINT64_MAX;
+
+    std::time_t seconds = static_cast<std::time_t>(now / 1000000000ull);
+    std::tm time_info;
+    localtime_r(&seconds, &time_info);
+    time_info.tm_sec = 0;
+    time_info.tm_min = 0;
+    if(interval == rotation_interval::daily)
+    {
+        time_info.tm_hour = 0;
+        time_info.tm_mday += 1;
+    }
+    else
+    {
+        time_info.tm_hour += 1;
+    }
+    time_info.tm_isdst = -1;
+    return static_cast<uint64_t>(std::mktime(&time_info)) * 1000000000ull;
+}
+
+
+/**
+ * @brief Compresses a file to <path>.gz and deletes the original.
+ * @param path The file to compress.
+ * @return true on success. On failure the original file is kept.
+ */
+bool logging::compress_file(const std::string& path)
+{
+#if LOGGING_HAVE_ZLIB
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0)
+        return false;
+
+    std::string target = path + ".gz";
+    gzFile out = gzopen(target.c_str(), "wb6");
+    if(!out)
+    {
+        ::close(in);
+        return false;
+    }
+
+    std::unique_ptr<char[]> chunk(new char[1 << 16]);
+    bool ok = true;
+    for(;;)
+    {
+        ssize_t n = ::read(in, chunk.get(), 1 << 16);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            ok = n == 0;
+            break;
+        }
+        if(gzwrite(out, chunk.get(), static_cast<unsigned>(n)) != n)
+        {
+            ok = false;
+            break;
+        }
+    }
+    ::close(in);
+    ok = gzclose(out) == Z_OK && ok;
+
+    if(ok)
+        ::unlink(path.c_str());
+    else
+        ::unlink(target.c_str());
+    return ok;
+#else
+    std::cerr << "Can't compress " << path << ", built without zlib" << std::endl;
+    return false;
+#endif
+}
+
+
+/**
+ * @brief Deletes the oldest rotated files of a log file beyond a given count.
+ * @param stem The log file path without its extension.
+ * @param ext The extension of the log file, including the dot. May be empty.
+ * @param keep_files The number of rotated files to keep.
+ */
+void logging::prune_rotated(const std::string& stem, const std::string& ext, unsigned keep_files)
+{
+    size_t slash = stem.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : stem.substr(0, slash);
+    std::string prefix = (slash == std::string::npos ? stem : stem.substr(slash + 1)) + ".";
+
+    std::vector<std::pair<std::filesystem::file_time_type, std::string>> found;
+    std::error_code error;
+    for(const auto& entry : std::filesystem::directory_iterator(dir, error))
+    {
+        std::string file = entry.path().filename().string();
+        std::string base = file.size() > 3 && file.compare(file.size() - 3, 3, ".gz") == 0
+                         ? file.substr(0, file.size() - 3) : file;
+        if(base.size() < prefix.size() + 15 + ext.size() || base.compare(0, prefix.size(), prefix) != 0 ||
+           base.compare(base.size() - ext.size(), ext.size(), ext) != 0)
+            continue;
+
+        // The part between the prefix and the extension must be a rotation stamp
+        std::string stamp = base.substr(prefix.size(), base.size() - prefix.size() - ext.size());
+        if(stamp[8] != '-' || stamp.find_first_not_of("0123456789-") != std::string::npos)
+            continue;
+        found.emplace_back(entry.last_write_time(error), file);
+    }
+
+    if(found.size() <= keep_files)
+        return;
+
+    // Oldest first, the stamp breaks ties between files compressed within the same clock tick
+    std::sort(found.begin(), found.end());
+    for(size_t i = 0; i + keep_files < found.size(); ++i)
+    {
+        std::string path = dir + "/" + found[i].second;
+        ::unlink(path.c_str());
+        ::unlink((path + log_index::suffix).c_str());
+
+        // And the segments of a file written with the mmap backend, compressed or not
+        std::string base = path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0
+                         ? path.substr(0, path.size() - 3) : path;
+        for(unsigned n = 1;; ++n)
+        {
+            std::string part = base + "." + std::to_string(n);
+            bool removed = ::unlink(part.c_str()) == 0;
+            if(::unlink((part + ".gz").c_str()) != 0 && !removed)
+                break;
+        }
+    }
+}
+
+
+/**
+ * @brief Opens a log file in append mode.
+ * @param filename The file to open. ".log" is appended if it has no extension.
+ * @return The opened file, or nullptr if it can't be opened.
  *
- * If the logger is set to print the logs to the console, the logged message will be printed to the console. If the logger is set to log
- * to a file, the logged message will be appended to the file.
+ * With the mmap backend the first segment is mapped right away.
  */
-void logging::add_log(log_level level, const char* fun_name, std::string message)
+logging::file_sink* logging::open_sink(std::string filename)
 {
+    if(filename.find_last_of('.') == std::string::npos)
+        filename += ".log";
 
-    std::string current_time = getCurrentTime();
-    // [time] [level] [function name] [message]
-    std::string log_message = "[" + formatField(current_time) + "] "
-                            + "[" + formatField(logLevelToString(level)) + "] "
-                            + "[" + formatField(fun_name) + "] "
-                            + message + "\n";
-    if(print_log)
-        std::cout << log_message;
+    // A file holds one format: a file written in the other one, e.g. by an earlier run, is moved aside
+    file_format format = file_fmt.load(std::memory_order_relaxed);
+    char start[sizeof(binary_format::magic)] = {};
+    int existing = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    bool binary = existing >= 0 && ::read(existing, start, sizeof(start)) == sizeof(start) &&
+                  std::memcmp(start, binary_format::magic, sizeof(start)) == 0;
+    bool written = existing >= 0 && ::lseek(existing, 0, SEEK_END) > 0;
+    if(existing >= 0)
+        ::close(existing);
+    if(written && binary != (format == file_format::binary))
+    {
+        std::string stem, ext;
+        std::string aside = rotated_name(filename, stem, ext);
+        if(::rename(filename.c_str(), aside.c_str()) == 0)
+        {
+            ::rename((filename + log_index::suffix).c_str(), (aside + log_index::suffix).c_str());
+            for(unsigned n = 1; ::rename((filename + "." + std::to_string(n)).c_str(),
+                                         (aside + "." + std::to_string(n)).c_str()) == 0; ++n)
+                ;
+        }
+    }
+
+    if(backend.load(std::memory_order_relaxed) == file_backend::mmap)
+    {
+        std::unique_ptr<mapped_file> mapped(new mapped_file{filename, segment_size.load(std::memory_order_relaxed)});
+        segment* first = mapped_file::open_segment(filename, mapped->segment_size);
+        if(first)
+        {
+            mapped->current.store(first);
+            file_sink* opened = new file_sink{-1, filename, nullptr, std::move(mapped), &flush_latency};
+            opened->format = format;
+            return opened;
+        }
+        // Fall back to plain writes, e.g. on file systems without mmap support
+    }
 
-    if(log_file.is_open())
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
     {
-        log_file.seekp(0, std::ios_base::end);
-        log_file << log_message;
+        std::cerr << "Can't open log file " << filename << std::endl;
+        return nullptr;
     }
+    // The ring is set up with the first buffer, a kernel without io_uring gets the plain buffer
+    bool use_uring = backend.load(std::memory_order_relaxed) == file_backend::uring;
+    file_sink* opened = new file_sink{fd, filename, nullptr, nullptr, &flush_latency, use_uring};
+    opened->format = format;
 
+    size_t block_size = index_block.load(std::memory_order_relaxed);
+    struct stat info;
+    if(block_size && format == file_format::text && ::fstat(fd, &info) == 0)
+    {
+        opened->index = log_index::writer::open(filename, static_cast<uint64_t>(info.st_size), block_size);
+        if(!opened->index)
+            std::cerr << "Can't open log index " << filename << log_index::suffix << std::endl;
+    }
+    return opened;
 }
 
 
 /**
- * @brief Log a message with the default log level.
- * @param fun_name The name of the function that is logging.
- * @param message The message to log.
- * @details This function logs the message with the default log level.
+ * @brief Opens a segment file in append mode, preallocates it and maps it.
+ * @param path The segment file.
+ * @param min_size The number of bytes to preallocate after the current end of the file.
+ * @return The segment, or nullptr if the file can't be opened, allocated or mapped.
  */
-void logging::add_log(const char* fun_name, std::string message)
+logging::segment* logging::mapped_file::open_segment(const std::string& path, size_t min_size)
 {
-    std::string current_time = getCurrentTime();
-    // [time] [level] [function name] [message]
-    std::string log_message = "[" + formatField(current_time) + "] "
-                            + "[" + formatField(logLevelToString(level)) + "] "
-                            + "[" + formatField(fun_name) + "] "
-                            + message + "\n";
-    if(print_log)
-        std::cout << log_message;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        std::cerr << "Can't open log file " << path << std::endl;
+        return nullptr;
+    }
+
+    struct stat info;
+    if(::fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    // Keep what the file already holds: map from the page it ends in
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t end = static_cast<size_t>(info.st_size);
+    size_t map_offset = end & ~(page - 1);
+    size_t size = ((end - map_offset + min_size + page - 1) & ~(page - 1));
 
-    if(log_file.is_open())
+    if(::posix_fallocate(fd, static_cast<off_t>(end), static_cast<off_t>(map_offset + size - end)) != 0 &&
+       ::ftruncate(fd, static_cast<off_t>(map_offset + size)) != 0)
     {
-        log_file.seekp(0, std::ios_base::end);
-        log_file << log_message;
+        ::close(fd);
+        return nullptr;
     }
+
+    void* map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(map_offset));
+    if(map == MAP_FAILED)
+    {
+        ::ftruncate(fd, static_cast<off_t>(end));
+        ::close(fd);
+        return nullptr;
+    }
+
+    segment* seg = new segment{fd, static_cast<char*>(map), map_offset, size, {end - map_offset}, {end - map_offset}};
+    return seg;
 }
 
 
 /**
- * @brief Set the log level for the logger.
- * @param level The new log level.
- * @details This function sets the log level for the logger. All log messages
- *          with a level below the set log level will be discarded.
+ * @brief Unmaps a segment and cuts the file back to the bytes that were written.
+ * @param seg The segment. Every writer that reserved a range in it must have finished.
+ * @param used The number of bytes of the mapping that hold log data.
  */
-void logging::set_log_level(log_level level)
+void logging::mapped_file::close_segment(segment* seg, size_t used)
 {
-     this->level = level; 
+    if(!seg->map)
+        return;
+    ::munmap(seg->map, seg->size);
+    ::ftruncate(seg->fd, static_cast<off_t>(seg->map_offset + used));
+    ::close(seg->fd);
+    seg->map = nullptr;
 }
 
 
 /**
- * @brief Get the global logging instance.
- * @param filename The filename to log to.
- * @param print_log Whether to print the log to the console.
- * @return The global logging instance.
+ * @brief Copies data into the current segment.
+ * @param parts The data, written as one contiguous range.
+ * @param count The number of parts.
+ *
+ * Writers reserve their range with a single fetch_add, so writing needs neither a lock nor a
+ * system call. The writer whose range crosses the end of the segment rolls over: it maps the
+ * next segment file (filename.1, filename.2, ...), publishes it, waits for the writers still
+ * copying into the old segment and cuts the old file back to its used size. Writers whose
+ * range lies completely past the end wait for the new segment and retry.
  */
-logging* logging::get_instance(std::string filename, bool print_log) {
-    std::lock_guard<std::mutex> lock(instance_mutex); // Ensure thread safety
-    if (!instance) {
-        instance.reset(new logging(filename, print_log));
+void logging::mapped_file::write(const iovec* parts, int count)
+{
+    size_t size = 0;
+    for(int i = 0; i < count; ++i)
+        size += parts[i].iov_len;
+
+    for(;;)
+    {
+        segment* seg = current.load(std::memory_order_acquire);
+        size_t offset = seg->reserved.fetch_add(size, std::memory_order_relaxed);
+        if(offset + size <= seg->size)
+        {
+            char* out = seg->map + offset;
+            for(int i = 0; i < count; ++i)
+            {
+                std::memcpy(out, parts[i].iov_base, parts[i].iov_len);
+                out += parts[i].iov_len;
+            }
+            seg->committed.fetch_add(size, std::memory_order_release);
+            return;
+        }
+
+        if(offset > seg->size)
+        {
+            // Someone else rolls over
+            while(current.load(std::memory_order_acquire) == seg)
+                std::this_thread::yield();
+            continue;
+        }
+
+        // This range crosses the end: roll over to the next segment
+        segment* next = open_segment(filename + "." + std::to_string(next_index++), std::max(segment_size, size));
+        bool failed = !next;
+        if(failed)
+        {
+            // An empty segment, the next writer tries to roll over again. Lines are lost until that works
+            next = new segment{-1, nullptr, 0, 0, {0}, {0}};
+        }
+        seg->next_retired = retired;
+        retired = seg;
+        current.store(next, std::memory_order_release);
+
+        while(seg->committed.load(std::memory_order_acquire) != offset)
+            std::this_thread::yield();
+        close_segment(seg, offset);
+        if(failed)
+            return;
     }
-    return instance.get();
 }
 
 
 /**
- * @brief Changes the log file used by the logger.
- * @param new_filename The new filename to log to.
+ * @brief Copies data into the space left in the current segment, for the crash handler.
+ * @param parts The data, written as one contiguous range.
+ * @param count The number of parts.
+ * @return false if it doesn't fit, nothing is written then.
  *
- * If a filename is provided, the log file will be opened in append mode.
- * If the file cannot be opened, the logger will fall back to printing to the console
- * and a message will be printed to the standard error stream. If the log file is
- * currently open, it will be closed before the new log file is opened.
+ * Async-signal-safe: unlike write it never rolls over, which opens and maps a file, and never
+ * waits for other writers, the crashed thread may have reserved a range it never commits.
  */
-void logging::change_log_file(const std::string& new_filename)
+bool logging::mapped_file::write_on_crash(const iovec* parts, int count)
 {
-    std::lock_guard<std::mutex> lock(instance_mutex); // Ensure thread safety
+    size_t size = 0;
+    for(int i = 0; i < count; ++i)
+        size += parts[i].iov_len;
 
-    // Close the current log file if it is open
-    if (log_file.is_open())
+    segment* seg = current.load(std::memory_order_acquire);
+    size_t offset = seg->reserved.load(std::memory_order_relaxed);
+    do
     {
-        log_file.close();
+        if(!seg->map || offset + size > seg->size)
+            return false;
     }
+    while(!seg->reserved.compare_exchange_weak(offset, offset + size, std::memory_order_relaxed));
 
-    // Set the new filename and open the new log file
-    filename = new_filename;
-    if(!filename.empty())
+    char* out = seg->map + offset;
+    for(int i = 0; i < count; ++i)
     {
-        if(filename.find_last_of('.') == std::string::npos)
-            filename += ".log";
-        log_file.open(filename, std::ios::app);
-        if (!log_file.is_open())
-        {
-            std::cerr << "Can't open log file " << filename << std::endl;
-            print_log = false;
-        }
+        std::memcpy(out, parts[i].iov_base, parts[i].iov_len);
+        out += parts[i].iov_len;
+    }
+    seg->committed.fetch_add(size, std::memory_order_release);
+    return true;
+}
+
+
+/**
+ * @brief Closes the current segment, cutting its file back to the used size.
+ */
+logging::mapped_file::~mapped_file()
+{
+    segment* seg = current.load();
+    if(seg)
+    {
+        close_segment(seg, std::min(seg->reserved.load(), seg->size));
+        delete seg;
+    }
+    while(retired)
+    {
+        segment* next = retired->next_retired;
+        delete retired;
+        retired = next;
+    }
+}
+
+
+/**
+ * @brief Appends data to the write combining buffer, flushing it first if the data does not fit.
+ * @param parts The data to write.
+ * @param count The number of parts.
+ * @param buffer_size The configured buffer size. The buffer is reallocated when it changes,
+ *        0 writes straight to the file.
+ *
+ * The buffer is page aligned so the kernel can copy it efficiently. Data larger than the
+ * buffer is written directly after the buffered data. With the uring backend the buffer is one
+ * of the buffers of the uring_writer.
+ */
+void logging::file_sink::write(iovec* parts, int count, size_t buffer_size)
+{
+    if(mapped)
+    {
+        mapped->write(parts, count);
+        return;
+    }
+
+    if(buffer_size != capacity)
+    {
+        flush(last_flush);
+        if(uring)
+            uring.reset();
+        else
+            std::free(buffer);
+        if(use_uring && buffer_size)
+            uring = uring_writer::create(fd, buffer_size);
+        if(uring)
+            buffer = uring->buffer();
+        else
+            buffer = buffer_size ? static_cast<char*>(std::aligned_alloc(4096, (buffer_size + 4095) & ~size_t(4095))) : nullptr;
+        capacity = buffer ? buffer_size : 0;
+    }
+
+    size_t size = 0;
+    for(int i = 0; i < count; ++i)
+        size += parts[i].iov_len;
+
+    if(used + size > capacity)
+        flush(last_flush);
+
+    if(size > capacity)
+    {
+        if(uring)
+            uring->wait_all();
+        writev_fully(fd, parts, count);
+        return;
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        std::memcpy(buffer + used, parts[i].iov_base, parts[i].iov_len);
+        used += parts[i].iov_len;
+    }
+}
+
+
+/**
+ * @brief Writes data straight to the file, bypassing the write combining buffer.
+ * @param parts The data to write, as one line.
+ * @param count The number of parts.
+ */
+void logging::file_sink::write_direct(iovec* parts, int count)
+{
+    if(mapped)
+        mapped->write(parts, count);
+    else
+        writev_fully(fd, parts, count);
+}
+
+
+/**
+ * @brief Get the number of bytes in the log file.
+ * @return The size of the file, for a mapped file the used part of the current segment file.
+ */
+uint64_t logging::file_sink::size() const
+{
+    if(mapped)
+    {
+        segment* seg = mapped->current.load();
+        return seg->map_offset + std::min(seg->reserved.load(std::memory_order_relaxed), seg->size);
+    }
+
+    struct stat info;
+    if(::fstat(fd, &info) != 0)
+        return 0;
+    return static_cast<uint64_t>(info.st_size);
+}
+
+
+/**
+ * @brief Writes the buffered data with a single write.
+ * @param now The current time, in ns since epoch, remembered for the flush interval.
+ * @details With the uring backend the buffer is submitted and the next one is filled while the
+ *          kernel writes it, see uring_writer.
+ */
+void logging::file_sink::flush(uint64_t now)
+{
+    last_flush = now;
+    if(mapped)
+        return;
+    if(used == 0)
+        return;
+
+    uint64_t start = steady_ns();
+    if(uring)
+    {
+        uring->submit(used);
+        buffer = uring->buffer();
+    }
+    else
+    {
+        iovec part = {buffer, used};
+        writev_fully(fd, &part, 1);
     }
+    used = 0;
+    if(flush_latency)
+        flush_latency->record(steady_ns() - start);
+}
+
+
+/**
+ * @brief Flushes the buffered data and closes the log file.
+ */
+logging::file_sink::~file_sink()
+{
+    flush(last_flush);
+    if(uring)
+        uring.reset();
+    else
+        std::free(buffer);
+    if(fd >= 0)
+        ::close(fd);
 }
 
 
 /**
  * @brief Destructor for the logging class.
  *
- * Closes the log file if it is still open.
+ * Stops the writer thread after it has written every queued record and
+ * closes the log file if it is still open.
  */
 logging::~logging()
 {
-    if(log_file.is_open())
-        log_file.close();
+    // A crash from now on must not drain a logger that is going away
+    logging* self = this;
+    crash_logger.compare_exchange_strong(self, nullptr);
+
+    // The rotation thread may still log a stats report
+    {
+        std::lock_guard<std::mutex> lock(rotation_mutex);
+        rotation_stop = true;
+        rotation_wakeup.notify_one();
+    }
+    if(rotator.joinable())
+        rotator.join();
+    if(aggregate_timers.load(std::memory_order_relaxed))
+        report_timers();
+
+    if(writer.joinable())
+    {
+        writer_stop.store(true, std::memory_order_release);
+        wake_writer();
+        writer.join();
+    }
+
+    sink_list* list = sinks.exchange(nullptr);
+    if(list)
+    {
+        epoch::synchronize();
+        for(sink_slot* slot : list->slots)
+            stop_sink(slot);
+        delete list;
+    }
+
+    delete sink.exchange(nullptr);
+
+}
+
+
+/**
+ * @brief Write a set of buffers to a file descriptor, retrying on partial writes and EINTR.
+ * @param fd The file descriptor to write to.
+ * @param parts The buffers to write. They are advanced past the written bytes.
+ * @param count The number of buffers.
+ */
+void writev_fully(int fd, iovec* parts, int count)
+{
+    while(count > 0)
+    {
+        ssize_t written = ::writev(fd, parts, count);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
 
+        size_t left = static_cast<size_t>(written);
+        while(count > 0 && left >= parts->iov_len)
+        {
+            left -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+        if(count > 0)
+        {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + left;
+            parts->iov_len -= left;
+        }
+    }
 }
 
 
@@ -190,15 +3296,9 @@ logging::~logging()
  */
 std::string getCurrentTime() 
 {
-    auto now = std::chrono::system_clock::now();
-    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
-    std::time_t current_time = std::chrono::system_clock::to_time_t(now);
-    std::tm* time_info = std::localtime(&current_time);
-
-    std::ostringstream oss;
-    oss << std::put_time(time_info, "%H:%M:%S") << '.' 
-        << std::setfill('0') << std::setw(3) << ms.count();
-    return oss.str();
+    char buffer[timestamp::max_length];
+    size_t length = timestamp::format(timestamp::now(), buffer);
+    return std::string(buffer, length);
 }
 
 
@@ -234,4 +3334,64 @@ std::string logLevelToString(logging::log_level level)
         case logging::log_level::FATAL:   return "FATAL";
         default:                      return "UNKNOWN";
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * @brief Formats the counters of the logger in the Prometheus text exposition format.
+ * @param counters The counters, see logging::get_stats.
+ * @return The metrics, one per line.
+ */
+std::string formatPrometheus(const logging::stats& counters)
+{
+    std::string out;
+    auto metric = [&out](const char* name, const char* type, const char* help)
+    {
+        out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+        out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+    };
+    auto value = [&out](const std::string& name, uint64_t number)
+    {
+        out += name; out += ' '; out += std::to_string(number); out += '\n';
+    };
+    auto seconds = [&out](const std::string& name, uint64_t ns)
+    {
+        char number[32];
+        std::snprintf(number, sizeof(number), "%.9f", static_cast<double>(ns) / 1e9);
+        out += name; out += ' '; out += number; out += '\n';
+    };
+
+    metric("logging_records_total", "counter", "Records logged by level.");
+    for(size_t i = 0; i < logging::level_count; ++i)
+        value("logging_records_total{level=\"" + logLevelToString(static_cast<logging::log_level>(i)) + "\"}",
+              counters.records[i]);
+
+    metric("logging_bytes_written_total", "counter", "Bytes written to the console and the log file.");
+    value("logging_bytes_written_total", counters.bytes_written);
+    metric("logging_dropped_records_total", "counter", "Records discarded because a queue was full.");
+    value("logging_dropped_records_total", counters.dropped);
+    metric("logging_queue_high_water", "gauge", "Most records found waiting in one async queue.");
+    value("logging_queue_high_water", counters.queue_high_water);
+
+    metric("logging_flush_seconds", "histogram", "Time spent writing the buffered log file data.");
+    uint64_t flushes = 0;
+    for(size_t i = 0; i + 1 < logging::histogram_buckets; ++i)
+    {
+        flushes += counters.flush_latency[i];
+        char bound[32];
+        std::snprintf(bound, sizeof(bound), "%.9g", static_cast<double>(uint64_t(1) << i) / 1e9);
+        value(std::string("logging_flush_seconds_bucket{le=\"") + bound + "\"}", flushes);
+    }
+    flushes += counters.flush_latency[logging::histogram_buckets - 1];
+    value("logging_flush_seconds_bucket{le=\"+Inf\"}", flushes);
+    seconds("logging_flush_seconds_sum", counters.flush_ns);
+    value("logging_flush_seconds_count", flushes);
+
+    metric("logging_clock_seconds", "summary", "Sampled time spent reading the clock.");
+    seconds("logging_clock_seconds_sum", counters.clock_ns);
+    value("logging_clock_seconds_count", counters.clock_samples);
+    metric("logging_format_seconds", "summary", "Sampled time spent formatting headers and messages.");
+    seconds("logging_format_seconds_sum", counters.format_ns);
+    value("logging_format_seconds_count", counters.format_samples);
+    return out;
+}
@@ -18,8 +18,29 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <sys/uio.h>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "ring_buffer.hpp"
+#include "epoch.hpp"
+#include "spill_pool.hpp"
+#include "uring_writer.hpp"
+#include "timestamp.hpp"
+#include "log_args.hpp"
+#include "binary_format.hpp"
+#include "log_index.hpp"
+#include <tuple>
+#include <exception>
+
+class log_sink;
 
 class logging
 {
@@ -35,16 +56,745 @@ public:
         UNKNOWN
     };
 
+    /* enum class mode: where the log lines are written from */
+    enum class mode: uint8_t
+    {
+        sync,           // written on the calling thread
+        async           // queued and written by a background writer thread
+    };
+
+    /* enum class overflow_policy: what async mode does when the queue is full */
+    enum class overflow_policy: uint8_t
+    {
+        block,          // wait until the writer makes room
+        drop_newest,    // discard the record being logged
+        drop_oldest     // discard the oldest queued record
+    };
+
+    /* enum class wait_strategy: what the writer thread does while every queue is empty */
+    enum class wait_strategy: uint8_t
+    {
+        backoff,        // spin, then yield, then sleep 500 us
+        spin,           // never gives up its core, for the lowest latency
+        futex,          // spin, then block until a logging thread wakes it
+        sleep           // sleep writer_options::sleep_interval between looks
+    };
+
+    /* enum class file_format: how records are stored in the log file */
+    enum class file_format: uint8_t
+    {
+        text,           // "[time] [level] [function] message" lines
+        binary          // compact records with interned names, see binary_format.hpp and logdecode
+    };
+
+    /* enum class line_format: how the lines on the console and in a text log file are laid out */
+    enum class line_format: uint8_t
+    {
+        text,           // "[time] [level] [function] message key=value"
+        json,           // one JSON object per line, the fields of log_args::kv as members
+        logfmt          // ts=... level=... function=... msg="..." key=value
+    };
+
+    /* enum class file_backend: how bytes get into the log file */
+    enum class file_backend: uint8_t
+    {
+        write,          // write(2) from the logging thread, or batched by the writer thread
+        mmap,           // copied into preallocated, memory mapped segments without system calls
+        uring           // like write, but the writer thread's batches are submitted to an io_uring
+    };
+
+    /* enum class rotation_interval: time based rotation of the log file */
+    enum class rotation_interval: uint8_t
+    {
+        none,
+        hourly,         // at the start of every local hour
+        daily           // at local midnight
+    };
+
+    /* enum class compression: what happens to a rotated file */
+    enum class compression: uint8_t
+    {
+        none,
+        gzip            // compressed to <file>.gz by the background thread, needs zlib
+    };
+
+    /* Rotation settings, a zero or none field disables that criterion */
+    struct rotation_policy
+    {
+        uint64_t max_bytes = 0;                         // rotate once the file is larger
+        rotation_interval interval = rotation_interval::none;
+        unsigned keep_files = 0;                        // rotated files to keep, 0 keeps all
+        compression compress = compression::none;
+    };
+
+    /* Placement and waiting of the async writer thread, see set_writer_options */
+    struct writer_options
+    {
+        std::vector<int> cpus;                          // the CPUs it may run on, empty for any
+        int nice = 0;
+        bool idle_priority = false;                     // SCHED_IDLE, runs only when a CPU has nothing else to do
+        wait_strategy wait = wait_strategy::backoff;
+        std::chrono::microseconds sleep_interval{1000}; // for wait_strategy::sleep
+        bool numa_local_queues = false;                 // move each thread's queue to its NUMA node
+    };
+
+    static constexpr size_t default_queue_capacity = 4096;            // records per logging thread
+    static constexpr size_t default_segment_size = 256 * 1024 * 1024;
+    static constexpr size_t default_file_buffer_size = 256 * 1024;
+    static constexpr size_t default_index_block = 64 * 1024;        // bytes of lines per entry of the file index
+    static constexpr std::chrono::milliseconds default_flush_interval{100};
+    static constexpr size_t field_width = 15;
+    static constexpr size_t inline_message_size = 176;
+    static constexpr size_t level_count = 6;
+    static constexpr size_t default_flight_records = 1024;          // flight recorder records per thread
+    static constexpr size_t default_flight_dump = 256;
+    static constexpr size_t flight_payload_size = 160;
+    static constexpr size_t histogram_buckets = 32;
+    static constexpr size_t default_reorder_records = 16384;        // records held to put them in time order
+
+    /* Settings of an output added with add_sink */
+    struct sink_options
+    {
+        log_level level = log_level::DEBUG;             // lines below are not written to this sink
+        size_t queue_capacity = 0;                      // own queue and thread when not 0, else written inline
+        overflow_policy policy = overflow_policy::drop_newest;  // what its queue does when it is full
+        std::chrono::milliseconds flush_interval = default_flush_interval;  // longest time between flushes
+    };
+
+    /* Counters of the logger itself, see get_stats. All of them count from the creation of the logger */
+    struct stats
+    {
+        uint64_t time;                          // ns since epoch when the counters were read
+        uint64_t records[level_count];          // records logged, indexed by log_level
+        uint64_t bytes_written;                 // bytes written to the console and the log file
+        uint64_t dropped;                       // records discarded by the overflow policy
+        uint64_t queue_high_water;              // most records the writer found waiting in one async queue
+        uint64_t flush_latency[histogram_buckets];  // log file flushes by duration: bucket i took less than 2^i ns
+        uint64_t flush_ns;                      // total time spent in the flushes
+        uint64_t clock_samples, clock_ns;       // sampled calls of timestamp::now() and the time they took
+        uint64_t format_samples, format_ns;     // sampled header and message formatting and the time it took
+    };
+
+    /* What a LOG_* call site knows at compile time. Each call site has one static constexpr instance, see LOGGING_LOG */
+    struct log_site
+    {
+        log_level level;
+        uint8_t name_length;
+        char name[field_width];         // the function name, already cut to the field width
+        const char* function;
+        const char* file;
+        unsigned line;
+
+        constexpr log_site(log_level level, const char* function, const char* file, unsigned line)
+            : level(level), name_length(0), name{}, function(function), file(file), line(line)
+        {
+            while(name_length < field_width && function[name_length])
+            {
+                name[name_length] = function[name_length];
+                ++name_length;
+            }
+        }
+
+        std::string_view get_name() const { return std::string_view(name, name_length); }
+    };
+
+    /**
+     * @brief Rate limiting state of one LOG_EVERY_N, LOG_EVERY_MS or LOG_RATE_LIMITED call site.
+     *
+     * Each call site has one static instance. Deciding costs a load and one atomic operation on
+     * the call site's own state. Suppressed lines are counted and reported by a
+     * "suppressed N messages from <function>" line before the next line the site logs, and by flush().
+     */
+    class rate_limit
+    {
+    private:
+        friend class logging;
+        std::atomic<uint64_t> state{0};         // call count, or the time in ns the next line is allowed
+        std::atomic<uint64_t> suppressed{0};
+        std::atomic<bool> registered{false};
+        const log_site* site = nullptr;         // set before the limit is added to limited_sites
+        rate_limit* next = nullptr;
+
+        void note_suppressed(const log_site& at);
+
+    public:
+        /**
+         * @brief Lets the first of every n calls through.
+         * @param at The call site, for the suppressed summary.
+         */
+        bool every_n(const log_site& at, uint64_t n)
+        {
+            if(state.fetch_add(1, std::memory_order_relaxed) % (n ? n : 1) == 0)
+                return true;
+            note_suppressed(at);
+            return false;
+        }
+
+        /**
+         * @brief Lets at most one call per interval through.
+         * @param at The call site, for the suppressed summary.
+         * @param interval The interval in ns.
+         * @param now The current time in ns.
+         */
+        bool every_ns(const log_site& at, uint64_t interval, uint64_t now)
+        {
+            uint64_t allowed = state.load(std::memory_order_relaxed);
+            if(now >= allowed && state.compare_exchange_strong(allowed, now + interval, std::memory_order_relaxed))
+                return true;
+            note_suppressed(at);
+            return false;
+        }
+
+        /**
+         * @brief Token bucket: lets per_second calls a second through on average and bursts of up to burst calls.
+         * @param at The call site, for the suppressed summary.
+         * @param per_second The sustained rate.
+         * @param burst The bucket size.
+         * @param now The current time in ns.
+         *
+         * Kept as the time the bucket would be full again (the generic cell rate algorithm), so a
+         * single compare and swap updates it.
+         */
+        bool token_bucket(const log_site& at, uint64_t per_second, uint64_t burst, uint64_t now)
+        {
+            uint64_t interval = 1000000000ull / (per_second ? per_second : 1);
+            uint64_t tolerance = interval * (burst ? burst - 1 : 0);
+            uint64_t full_at = state.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                uint64_t base = full_at > now ? full_at : now;
+                if(base - now > tolerance)
+                {
+                    note_suppressed(at);
+                    return false;
+                }
+                if(state.compare_exchange_weak(full_at, base + interval, std::memory_order_relaxed))
+                    return true;
+            }
+        }
+
+        bool has_suppressed() const { return suppressed.load(std::memory_order_relaxed) != 0; }
+    };
+
+    class timer_stats;          // the durations of a LOG_SCOPE_TIMER call site, defined below
+    class scope_timer;
+
+    /**
+     * @brief Lines collected on one thread and logged together, see logging::batch().
+     *
+     * The lines share one time stamp, taken by the first add. commit hands them over as one queued
+     * record in async mode and writes them with one write per output in sync mode, so the lines of a
+     * batch stay together in the console and the log file. Format arguments are packed like the ones
+     * of add_log and rendered when the batch is written. The destructor commits what is left. A batch
+     * is used by one thread at a time.
+     */
+    class log_batch
+    {
+    private:
+        logging* owner;
+        uint64_t time = 0;
+        std::string entries;            // batch_entry headers, each followed by its payload
+        size_t count = 0;
+        log_level worst = log_level::DEBUG;
+
+        char* append(log_level level, std::string_view fun_name, const char* format, size_t payload_size);
+
+    public:
+        explicit log_batch(logging* owner) : owner(owner) {}
+        log_batch(const log_batch&) = delete;
+        log_batch& operator=(const log_batch&) = delete;
+        ~log_batch() { commit(); }
+
+        void add(log_level level, std::string_view fun_name, std::string_view message);
+
+        /**
+         * @brief Adds a line built from a format string and its arguments, see add_log(level, fun_name, format, args...).
+         */
+        template <typename Arg, typename... Args>
+        void add(log_level level, std::string_view fun_name, const char* format, const Arg& arg, const Args&... args)
+        {
+            if(level < owner->level.load(std::memory_order_relaxed))
+            {
+                if(level >= owner->floor_level.load(std::memory_order_relaxed))
+                    owner->defer(level, owner->level.load(std::memory_order_relaxed), fun_name, nullptr, format,
+                                 arg, args...);
+                return;
+            }
+            char* out = append(level, fun_name, format, log_args::packed_size_all(arg, args...));
+            log_args::pack_all(out, arg, args...);
+        }
+
+        size_t size() const { return count; }
+        void commit();
+        void discard();
+    };
+
+    /**
+     * @brief A named logger with a level of its own, see logging::get.
+     *
+     * A channel is only a name and a level in front of the default logger: its lines go through
+     * the same queues, writer thread, file and sinks, with the name added as the field logger=name.
+     * A line below the channel's level is dropped, or kept by the flight recorder of the default
+     * logger if that records its level. Channels live as long as the process, so a reference can
+     * be kept, e.g. in a static at the call site.
+     */
+    class channel
+    {
+    private:
+        std::string channel_name;
+        std::atomic<log_level> level;
+        logging* backend;
+
+    public:
+        channel(std::string name, logging* backend)
+            : channel_name(std::move(name)), level(backend->level.load(std::memory_order_relaxed)), backend(backend)
+        {
+        }
+        channel(const channel&) = delete;
+        channel& operator=(const channel&) = delete;
+
+        std::string_view name() const { return channel_name; }
+        void set_log_level(log_level new_level) { level.store(new_level, std::memory_order_relaxed); }
+        log_level get_log_level() const { return level.load(std::memory_order_relaxed); }
+
+        bool should_log(log_level level) const
+        {
+            return level >= this->level.load(std::memory_order_relaxed) || backend->flight_keeps(level);
+        }
+
+        void add_log(log_level level, std::string_view fun_name, std::string_view message)
+        {
+            add_log(level, fun_name, "{}", message);
+        }
+
+        /**
+         * @brief Logs a message built from a format string and its arguments, see logging::add_log.
+         */
+        template <typename Arg, typename... Args>
+        void add_log(log_level level, std::string_view fun_name, const char* format, const Arg& arg,
+                     const Args&... args)
+        {
+            if(!should_log(level))
+                return;
+            std::string_view tag = channel_name;
+            backend->defer(level, this->level.load(std::memory_order_relaxed), fun_name, nullptr, format, arg,
+                           args..., log_args::kv("logger", tag));
+        }
+    };
+
 private:
+    /* The channels by name. Replaced as a whole when a channel is added and freed like file_sink */
+    struct channel_map
+    {
+        std::unordered_map<std::string_view, channel*> by_name;     // the keys point into the channels
+    };
+
+    /* A queued log line. Lives in a ring buffer slot and is filled and written in place */
+    struct log_record
+    {
+        uint64_t time;                  // ns since epoch, see timestamp::now()
+        log_level level;
+        uint8_t fun_length;
+        char fun_name[field_width];     // already cut to the field width, not copied when site is set
+        const log_site* site;           // the call site of LOG_* calls, nullptr otherwise
+        const char* format;             // set for deferred records, the message then holds the packed arguments
+        uint32_t message_length;
+        char message[inline_message_size];
+        char* spill = nullptr;          // holds the message when it does not fit inline, from spill_pool
+
+        std::string_view get_fun_name() const
+        {
+            return site ? site->get_name() : std::string_view(fun_name, fun_length);
+        }
+        std::string_view get_message() const
+        {
+            if(message_length <= inline_message_size)
+                return std::string_view(message, message_length);
+            return std::string_view(spill, message_length);
+        }
+        /* Called by whoever takes the record off its queue, once it is written */
+        void release()
+        {
+            if(spill)
+                spill_pool::release(spill);
+            spill = nullptr;
+        }
+    };
+
+    /* The header of a line in a log_batch, its payload follows it. Copied in and out unaligned */
+    struct batch_entry
+    {
+        const char* format;             // nullptr for a plain message
+        uint32_t length;
+        log_level level;
+        uint8_t fun_length;
+        char fun_name[field_width];
+    };
+
+    /* The format of the queued record that holds a log_batch, its message is the batch entries */
+    static constexpr char batch_format[] = "";
+
+    /* Log2 latency histogram, see stats::flush_latency */
+    struct histogram
+    {
+        std::atomic<uint64_t> buckets[histogram_buckets]{};
+        std::atomic<uint64_t> sum{0};
+
+        void record(uint64_t ns);
+    };
+
+    /* Counters of one thread. Only that thread writes them, get_stats adds them up */
+    struct thread_stats
+    {
+        static constexpr uint32_t sample_interval = 64;     // one call in sample_interval is timed
+
+        std::atomic<uint64_t> records[level_count]{};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> clock_samples{0}, clock_ns{0};
+        std::atomic<uint64_t> format_samples{0}, format_ns{0};
+        std::atomic<bool> abandoned{false};     // the thread has exited, folded into retired_stats
+        uint32_t clock_countdown = 1;
+        uint32_t format_countdown = 1;
+
+        /* A plain load and store, as no other thread writes the counter */
+        static void add(std::atomic<uint64_t>& counter, uint64_t n)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        static bool sample(uint32_t& countdown)
+        {
+            if(--countdown)
+                return false;
+            countdown = sample_interval;
+            return true;
+        }
+    };
+
+    /* A record kept by the flight recorder. Copied in and out of its slot word by word */
+    struct flight_record
+    {
+        uint64_t time;
+        const log_site* site;
+        const char* format;             // nullptr for a plain message
+        uint32_t length;                // bytes of payload used
+        log_level level;
+        uint8_t fun_length;
+        char fun_name[field_width];     // not set when site is
+        char payload[flight_payload_size];  // the message or the packed arguments, a longer message is cut
+
+        std::string_view get_fun_name() const
+        {
+            return site ? site->get_name() : std::string_view(fun_name, fun_length);
+        }
+    };
+
+    static_assert(sizeof(flight_record) % sizeof(uint64_t) == 0, "a flight record is copied in whole words");
+
+    /* A slot of a flight_ring, guarded as a seqlock: the sequence is odd while the owner writes it */
+    struct flight_slot
+    {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> words[sizeof(flight_record) / sizeof(uint64_t)];
+    };
+
+    /* The flight recorder ring of one thread. Only that thread writes it, a dump reads all of them */
+    struct flight_ring
+    {
+        std::unique_ptr<flight_slot[]> slots;
+        size_t capacity;
+        std::atomic<uint64_t> written{0};
+        std::atomic<bool> abandoned{false};     // the thread has exited
+
+        explicit flight_ring(size_t capacity) : slots(new flight_slot[capacity]), capacity(capacity) {}
+        void store(const flight_record& record);
+        bool load(uint64_t index, flight_record& record) const;
+    };
+
+    /* One mapped, preallocated segment file of a mapped_file */
+    struct segment
+    {
+        int fd;
+        char* map;                      // mapping of the file from map_offset on
+        size_t map_offset;              // page aligned file offset of map
+        size_t size;                    // size of the mapping
+        std::atomic<size_t> reserved;   // bytes of the mapping handed out to writers
+        std::atomic<size_t> committed;  // bytes of the mapping written
+        segment* next_retired = nullptr;
+    };
+
+    /* A log file written through mmap: writers reserve a byte range and copy their line into it */
+    struct mapped_file
+    {
+        std::string filename;
+        size_t segment_size;
+        unsigned next_index = 1;        // only touched by the writer that rolls over a segment
+        std::atomic<segment*> current{nullptr};
+        segment* retired = nullptr;     // closed segments, freed with the file
+
+        void write(const iovec* parts, int count);
+        bool write_on_crash(const iovec* parts, int count);
+        static segment* open_segment(const std::string& path, size_t min_size);
+        static void close_segment(segment* seg, size_t used);
+        ~mapped_file();
+    };
+
+    /* An open log file. Swapped as a whole by change_log_file and freed once no thread can still be writing to it */
+    struct file_sink
+    {
+        int fd;                         // -1 when the file is written through mapped
+        std::string filename;
+        std::unique_ptr<binary_format::encoder> encoder;    // binary session state, only used by the writer thread
+        std::unique_ptr<mapped_file> mapped;
+        histogram* flush_latency = nullptr;
+        bool use_uring = false;         // the file_backend::uring was asked for
+        std::unique_ptr<uring_writer> uring{};  // owns buffer while it is set, nullptr without io_uring
+        std::unique_ptr<log_index::writer> index{};     // the sidecar index, only used by the writer thread
+        file_format format = file_format::text;         // the format the file is written in, set by open_sink
+
+        // Write combining buffer, only used by the writer thread
+        char* buffer = nullptr;
+        size_t capacity = 0;
+        size_t used = 0;
+        uint64_t last_flush = 0;
+
+        void write(iovec* parts, int count, size_t buffer_size);
+        void write_direct(iovec* parts, int count);
+        uint64_t size() const;
+        void flush(uint64_t now);
+        ~file_sink();
+    };
+
+    /* An output added with add_sink, with its own queue and thread if it asked for one */
+    struct sink_slot
+    {
+        std::shared_ptr<log_sink> output;
+        sink_options options;
+        std::unique_ptr<ring_buffer<log_record>> queue;
+        std::thread thread;
+        std::atomic<bool> stop{false};
+        std::atomic<bool> flush_requested{false};
+        std::atomic<uint64_t> last_flush{0};
+    };
+
+    /* The outputs added with add_sink. Replaced as a whole and freed like file_sink */
+    struct sink_list
+    {
+        std::vector<sink_slot*> slots;
+    };
+
+    /* The async queue of one logging thread. Only that thread pushes, the writer thread drains all of them */
+    struct thread_queue
+    {
+        ring_buffer<log_record> records;
+        std::atomic<bool> abandoned{false};     // the thread has exited, freed by the writer once drained
+
+        explicit thread_queue(size_t capacity) : records(capacity) {}
+    };
+
+    /* Records the writer has taken off the thread queues and holds to write them in time order, see set_time_order */
+    struct reorder_buffer
+    {
+        struct held_record
+        {
+            uint64_t time;
+            uint64_t sequence;          // taken order, keeps the records of one thread in order on equal times
+            uint32_t slot;
+
+            bool operator>(const held_record& other) const
+            {
+                return time != other.time ? time > other.time : sequence > other.sequence;
+            }
+        };
+
+        std::vector<log_record> records;        // the slots, reused through free_slots
+        std::vector<uint32_t> free_slots;
+        std::vector<held_record> heap;          // min-heap on time
+        uint64_t taken = 0;
+
+        void hold(const log_record& record);
+        size_t size() const { return heap.size(); }
+        uint64_t oldest() const { return heap.front().time; }
+        template <typename F>
+        void write_oldest(const F& write);
+    };
+
+    static constexpr size_t cache_line = 64;
+    static constexpr size_t crash_queue_slots = 1024;   // thread queues the crash handler finds
+
     static std::unique_ptr<logging> instance;
+    static std::atomic<logging*> shared_instance;          // instance.get() once it is made, read without the lock
+    static std::atomic<channel_map*> channels;
+    static std::mutex channels_mutex;                       // taken to add a channel, lookups take no lock
     static std::mutex instance_mutex;
-    bool print_log;
+    static std::atomic<logging*> crash_logger;             // drained by the crash handler
+    static std::atomic<rate_limit*> limited_sites;         // rate limits that have suppressed lines
+    static std::atomic<timer_stats*> timed_sites;           // scope timers that have recorded durations
+    static std::terminate_handler previous_terminate;
+    std::atomic<bool> print_log;
     std::string filename;
-    std::ofstream log_file;
-    log_level level;
+    std::atomic<file_sink*> sink{nullptr};
+    std::atomic<sink_list*> sinks{nullptr};
+    std::atomic<log_level> level{log_level::DEBUG};
+    std::atomic<log_level> floor_level{log_level::DEBUG};      // lowest level kept, level or the flight recorder's
+    std::atomic<log_level> flight_level{log_level::DEBUG};
+    std::atomic<size_t> flight_capacity{0};                     // records per thread, 0 when it is off
+    std::atomic<size_t> flight_dump{default_flight_dump};
+
+    std::atomic<file_format> file_fmt{file_format::text};
+    std::atomic<line_format> line_fmt{line_format::text};
+    std::atomic<bool> sanitize{false};
+    std::atomic<file_backend> backend{file_backend::write};
+    std::atomic<size_t> segment_size{default_segment_size};
+    std::atomic<size_t> file_buffer_size{default_file_buffer_size};
+    std::atomic<size_t> index_block{0};                         // 0 when the log file is not indexed
+    std::atomic<uint64_t> flush_interval_ns{std::chrono::nanoseconds(default_flush_interval).count()};
+    std::atomic<timestamp::precision> time_precision{timestamp::precision::milliseconds};
+
+    std::atomic<mode> log_mode{mode::sync};
+    std::atomic<overflow_policy> policy{overflow_policy::block};
+    std::atomic<size_t> queue_capacity{default_queue_capacity};
+    std::atomic<uint64_t> reorder_window_ns{0};                 // 0 when the writer does not reorder
+    std::atomic<wait_strategy> writer_wait{wait_strategy::backoff};
+    std::atomic<uint64_t> writer_sleep_ns{1000000};
+    std::atomic<bool> numa_local{false};
+    std::atomic<bool> aggregate_timers{false};                  // scope timers record instead of logging
+    std::atomic<uint64_t> writer_settings_version{0};           // bumped by set_writer_options
+    std::atomic<size_t> reorder_records{default_reorder_records};
+    const uint64_t id;                  // tells the thread-local queues of different loggers apart
+
+    // Everything above is read by every logging thread and rarely written. What the logging
+    // threads or the writer write goes to the following cache lines, so it doesn't invalidate it
+    alignas(cache_line) std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> writer_stop{false};
+    std::atomic<bool> flush_requested{false};
+    std::atomic<bool> crashing{false};          // the crash handler takes over, the writer stops
+    std::atomic<bool> writer_parked{false};
+    std::atomic<bool> writer_sleeping{false};   // the writer blocks on writer_wakeup, see notify_writer
+    std::atomic<uint32_t> writer_wakeup{0};     // futex word, bumped to wake the writer
+    std::atomic<uint64_t> queues_version{0};    // bumped when thread_queues changes
+    std::atomic<uint64_t> queue_high_water{0};  // only written by the writer thread
+    histogram flush_latency;
+    reorder_buffer reordered;           // only used by the writer thread and drain_on_crash
+
+    std::mutex queues_mutex;
+    std::vector<std::shared_ptr<thread_queue>> thread_queues;  // guarded by queues_mutex
+    std::atomic<thread_queue*> crash_queues[crash_queue_slots]{};   // copy of thread_queues for drain_on_crash
+    std::thread writer;
+    writer_options writer_settings;     // guarded by writer_settings_mutex
+    std::mutex writer_settings_mutex;
+
+    std::mutex flight_mutex;
+    std::vector<std::shared_ptr<flight_ring>> flight_rings;    // guarded by flight_mutex
+    uint64_t flight_dumped = 0;         // records up to this time have been dumped, guarded by flight_mutex
+
+    mutable std::mutex stats_mutex;
+    std::vector<std::shared_ptr<thread_stats>> thread_counters;    // guarded by stats_mutex
+    stats retired_stats{};              // counters of the exited threads, guarded by stats_mutex
+
+    rotation_policy rotation;           // guarded by rotation_mutex
+    uint64_t next_rotation = 0;         // ns since epoch, only used by the rotation thread
+    bool rotation_stop = false;
+    std::mutex rotation_mutex;
+    std::condition_variable rotation_wakeup;
+    std::thread rotator;                // also reports the stats
+    uint64_t stats_interval = 0;        // ns, 0 when the stats are not reported, guarded by rotation_mutex
+    uint64_t timer_interval = 0;        // ns, 0 when the scope timers log every scope, guarded by rotation_mutex
+    uint64_t next_timer_report = 0;
+    uint64_t next_stats = 0;
+    std::function<void(std::string_view)> stats_callback;      // guarded by rotation_mutex
+    stats last_stats{};                 // only used by the rotation thread
 
     logging() = delete;
-    logging(std::string filename = "" , bool print_log = true);
+    logging(std::string filename = "" , bool print_log = true, mode log_mode = mode::sync);
+
+    file_sink* open_sink(std::string filename);
+    void swap_sink(file_sink* next);
+    void rotation_loop();
+    void start_rotator();
+    void report_stats(const std::function<void(std::string_view)>& callback);
+    void report_timers();
+    void rotate(const rotation_policy& policy);
+    static uint64_t next_rotation_time(uint64_t now, rotation_interval interval);
+    static std::string rotated_name(const std::string& filename, std::string& stem, std::string& ext);
+    static bool compress_file(const std::string& path);
+    static void prune_rotated(const std::string& stem, const std::string& ext, unsigned keep_files);
+    void write_log(uint64_t time, log_level level, std::string_view fun_name, std::string_view message,
+                   const char* format = nullptr, std::string* collect = nullptr);
+    void commit_batch(uint64_t time, log_level worst, std::string_view entries);
+    template <typename F>
+    static void for_each_entry(std::string_view entries, const F& write_entry);
+    template <typename F>
+    void push_record(ring_buffer<log_record>& target, overflow_policy overflow, uint64_t time, log_level level,
+                     std::string_view fun_name, const log_site* site, const char* format,
+                     size_t payload_size, const F& write_payload);
+    ring_buffer<log_record>& local_queue();
+    thread_stats& local_stats();
+    uint64_t count_record(log_level level);
+    void write_record(const log_record& record);
+    void write_entry(uint64_t time, log_level level, std::string_view fun_name, const log_site* site,
+                     const char* format, std::string_view payload);
+    bool flush_idle(bool force);
+    void write_sinks(uint64_t time, log_level level, std::string_view fun_name, std::string_view message,
+                     std::string_view header);
+    bool write_to_sink(sink_slot& slot, uint64_t time, log_level level, std::string_view fun_name,
+                       std::string_view message, std::string_view header);
+    void sink_loop(sink_slot* slot);
+    static void stop_sink(sink_slot* slot);
+
+    void add_message(log_level level, std::string_view fun_name, const log_site* site, std::string_view message);
+    void emit_record(uint64_t time, log_level level, std::string_view fun_name, const log_site* site,
+                     const char* format, std::string_view payload);
+    flight_ring* local_flight();
+    void capture(log_level level, std::string_view fun_name, const log_site* site, const char* format,
+                 const char* payload, size_t size);
+    void dump_flight(uint64_t now);
+    void update_floor();
+    bool flight_keeps(log_level level) const
+    {
+        return flight_capacity.load(std::memory_order_relaxed) && level >= flight_level.load(std::memory_order_relaxed);
+    }
+
+    using pack_function = void (*)(char* out, const void* args);
+    void add_deferred(log_level level, log_level threshold, std::string_view fun_name, const log_site* site,
+                      const char* format, size_t packed_size, pack_function pack, const void* args);
+
+    /**
+     * @brief Type erases the arguments of a deferred record and hands them to add_deferred.
+     * @param threshold The level of the logger or channel, a record below it only goes to the flight recorder.
+     */
+    template <typename... Args>
+    void defer(log_level level, log_level threshold, std::string_view fun_name, const log_site* site,
+               const char* format, const Args&... args)
+    {
+        auto packed = std::forward_as_tuple(args...);
+        using packed_type = decltype(packed);
+        add_deferred(level, threshold, fun_name, site, format, log_args::packed_size_all(args...),
+                     [](char* out, const void* values)
+                     {
+                         std::apply([out](const auto&... v) { log_args::pack_all(out, v...); },
+                                    *static_cast<const packed_type*>(values));
+                     },
+                     &packed);
+    }
+    void start_writer();
+    void writer_loop();
+    void apply_writer_settings();
+    void wake_writer();
+
+    /* Called after pushing to a thread queue. Wakes the writer if it blocks, see wait_strategy::futex */
+    void notify_writer()
+    {
+        if(writer_wait.load(std::memory_order_relaxed) != wait_strategy::futex)
+            return;
+        // Pairs with the fence of the writer: either it finds the record or this sees it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(writer_sleeping.load(std::memory_order_relaxed) && writer_sleeping.exchange(false, std::memory_order_relaxed))
+            wake_writer();
+    }
+    void drain_on_crash();
+    void publish_crash_queues();
+    static void crash_signal(int signal_number);
+    static void crash_terminate();
 public:
     
     logging(const logging&) = delete;               // delete copy constructor
@@ -55,13 +805,99 @@ public:
 
     friend std::string logLevelToString(log_level level);
 
-    static logging* get_instance(std::string filename = "", bool print_log = true);
+    static logging* get_instance(std::string filename = "", bool print_log = true,
+                                 mode log_mode = mode::sync);
+    static channel& get(std::string_view name);
+
+    /**
+     * @brief The instance made by get_instance, nullptr before it is made. A single atomic load.
+     */
+    static logging* existing_instance()
+    {
+        return shared_instance.load(std::memory_order_acquire);
+    }
     
-    void add_log(log_level level, const char* fun_name, std::string message);
-    void add_log(const char* fun_name, std::string message);
+    void add_log(log_level level, std::string_view fun_name, std::string_view message);
+    void add_log(std::string_view fun_name, std::string_view message);
+
+    /**
+     * @brief Logs a message built from a format string with {} placeholders and its arguments.
+     * @param format The format string. It must outlive the logger, e.g. a string literal.
+     *
+     * Only the arguments are copied on the calling thread. In async mode the text is rendered by
+     * the writer thread. Arguments may be numbers, bools, chars, pointers, enums and strings.
+     */
+    template <typename Arg, typename... Args>
+    void add_log(log_level level, std::string_view fun_name, const char* format,
+                 const Arg& arg, const Args&... args)
+    {
+        if(level < floor_level.load(std::memory_order_relaxed))
+            return;
+        defer(level, this->level.load(std::memory_order_relaxed), fun_name, nullptr, format, arg, args...);
+    }
+
+    void add_log(const log_site& site, std::string_view message);
+
+    /**
+     * @brief Logs a deferred record from a LOG_* call site, see add_log(level, fun_name, format, args...).
+     * @param site The static descriptor of the call site. Only a pointer to it is queued.
+     */
+    template <typename Arg, typename... Args>
+    void add_log(const log_site& site, const char* format, const Arg& arg, const Args&... args)
+    {
+        if(site.level < floor_level.load(std::memory_order_relaxed))
+            return;
+        defer(site.level, level.load(std::memory_order_relaxed), site.get_name(), &site, format, arg, args...);
+    }
+    log_batch batch();
     void set_log_level(log_level level);
+    void set_flight_recorder(size_t records_per_thread, log_level capture_level = log_level::DEBUG,
+                             size_t dump_records = default_flight_dump);
+
+    /**
+     * @brief Cheap check whether a message with the given level would be logged or kept by the flight recorder.
+     *        Used by the LOG_* macros so a filtered call does not even evaluate its arguments.
+     */
+    bool should_log(log_level level) const
+    {
+        return level >= floor_level.load(std::memory_order_relaxed);
+    }
+
     void change_log_file(const std::string& new_filename);
 
+    void set_print_log(bool print);
+    void flush();
+    void install_crash_handler();
+    void report_suppressed(const log_site& site, rate_limit& limit);
+
+    void add_sink(std::shared_ptr<log_sink> output, const sink_options& options);
+    void add_sink(std::shared_ptr<log_sink> output);
+    void remove_sink(const std::shared_ptr<log_sink>& output);
+
+    void set_mode(mode new_mode);
+    void set_overflow_policy(overflow_policy new_policy);
+    void set_queue_capacity(size_t capacity);
+    void set_time_order(std::chrono::microseconds reorder_window, size_t max_held = default_reorder_records);
+    void set_writer_options(const writer_options& options);
+    uint64_t dropped_count() const;
+
+    stats get_stats() const;
+    void export_stats(const std::function<void(std::string_view text)>& callback) const;
+    void set_timer_aggregation(std::chrono::milliseconds interval);
+    void set_stats_interval(std::chrono::milliseconds interval,
+                            std::function<void(std::string_view text)> callback = nullptr);
+
+    void set_file_format(file_format format);
+    void set_line_format(line_format layout);
+    void set_sanitize(bool enable);
+    void set_file_backend(file_backend new_backend, size_t new_segment_size = default_segment_size);
+    void set_rotation(const rotation_policy& policy);
+    void set_file_buffer(size_t buffer_size, std::chrono::milliseconds flush_interval = default_flush_interval);
+    void set_file_index(size_t block_size = default_index_block);
+
+    void set_clock_source(timestamp::clock_source source);
+    void set_timestamp_precision(timestamp::precision precision);
+
 
     static constexpr log_level DEBUG = log_level::DEBUG;
     static constexpr log_level INFO = log_level::INFO;
@@ -71,9 +907,289 @@ public:
 };
 
 
+/**
+ * @brief An output the logger writes to in addition to the console and the log file, see logging::add_sink.
+ *
+ * A sink without a queue is written by the thread that logs in sync mode and by the writer thread
+ * in async mode, so it must be thread-safe. A sink with a queue is only ever written and
+ * flushed by its own thread.
+ */
+class log_sink
+{
+public:
+    /* One log line as handed to a sink */
+    struct entry
+    {
+        uint64_t time;                  // ns since epoch
+        logging::log_level level;
+        std::string_view fun_name;
+        std::string_view header;        // "[time] [level] [function] " as written by formatHeader
+        std::string_view message;       // the rendered message, without a newline
+    };
+
+    virtual ~log_sink() = default;
+
+    /**
+     * @brief Writes one log line.
+     */
+    virtual void write(const entry& line) = 0;
+
+    /**
+     * @brief Writes out anything the sink buffers. Called after ERROR and FATAL lines, once the
+     *        flush interval has elapsed and by logging::flush.
+     */
+    virtual void flush() {}
+};
+
+
 std::string getCurrentTime();
 std::string formatField(const std::string& input, size_t width = 15);
+size_t formatHeader(char* out, uint64_t time, logging::log_level level, std::string_view fun_name,
+                    timestamp::precision precision = timestamp::precision::milliseconds, bool signal_safe = false);
+void writev_fully(int fd, iovec* parts, int count);
+void renderFormat(std::string& out, const char* format, std::string_view packed_args);
+size_t renderFormat(char* out, size_t capacity, const char* format, std::string_view packed_args);
+void formatLine(std::string& out, logging::line_format layout, uint64_t time, logging::log_level level,
+                std::string_view fun_name, const char* format, std::string_view payload,
+                timestamp::precision precision = timestamp::precision::milliseconds);
+std::string formatPrometheus(const logging::stats& counters);
+size_t findUnsafeByte(std::string_view text);
+void sanitizeText(std::string& out, std::string_view text);
+const char* scannerName();
+/* Length of the "[time] [level] [function] " prefix written by formatHeader */
+constexpr size_t log_header_length = 3 * (logging::field_width + 3);
+
 namespace logger {
-    extern logging* log;
+    /* Settings the default logger is made with on its first use, see configure */
+    struct settings
+    {
+        std::string filename = "app";
+        bool print_log = true;
+        logging::mode log_mode = logging::mode::sync;
+        std::function<void(logging&)> setup;    // called once the logger is made, e.g. to add sinks
+    };
+
+    bool configure(settings options);
+
+    /**
+     * @brief Handle of the default logger, which is made by its first use.
+     *
+     * The handle is empty and constant initialized, so nothing runs before main, a program that
+     * never logs does not open app.log, and other static constructors can log safely. Every use
+     * costs one atomic load. If get_instance was called first, the handle uses that instance.
+     */
+    class handle
+    {
+    private:
+        static logging* create();
+
+    public:
+        logging* get() const
+        {
+            logging* current = logging::existing_instance();
+            return current ? current : create();
+        }
+        logging* operator->() const { return get(); }
+        logging& operator*() const { return *get(); }
+        operator logging*() const { return get(); }
+    };
+
+    inline constexpr handle log{};
 }
 
+
+/**
+ * @brief Durations of one LOG_SCOPE_TIMER call site, collected while timer aggregation is on.
+ *
+ * Each call site has one static instance. Recording costs two relaxed atomic additions on the
+ * site's own log2 histogram. The site registers itself on its first record, like rate_limit, and
+ * the rotation thread reports and resets it, see logging::set_timer_aggregation.
+ */
+class logging::timer_stats
+{
+private:
+    friend class logging;
+    histogram durations;
+    std::atomic<uint64_t> longest{0};
+    std::atomic<bool> registered{false};
+    const log_site* site = nullptr;         // set before the timer is added to timed_sites
+    std::string_view name;
+    timer_stats* next = nullptr;
+
+    void register_site(const log_site& at, std::string_view timer_name);
+
+public:
+    void record(const log_site& at, std::string_view timer_name, uint64_t ns)
+    {
+        durations.record(ns);
+        uint64_t seen = longest.load(std::memory_order_relaxed);
+        while(ns > seen && !longest.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+            ;
+        if(!registered.load(std::memory_order_relaxed))
+            register_site(at, timer_name);
+    }
+};
+
+
+/**
+ * @brief Times the rest of a scope and logs or records the duration when the scope ends, see LOG_SCOPE_TIMER.
+ *
+ * The clock is timestamp::now(), so with the tsc clock source a measurement costs two rdtsc. The
+ * line "<name> took <n> ns" is a deferred record, its arguments are packed and formatted by the
+ * writer thread in async mode. A scope below the level set with set_log_level reads no clock,
+ * also when the flight recorder keeps records of its level: the line would never be written.
+ */
+class logging::scope_timer
+{
+private:
+    const log_site& site;
+    std::string_view name;
+    timer_stats& totals;
+    uint64_t start = 0;                     // 0 when the scope is not timed
+
+public:
+    scope_timer(const log_site& site, std::string_view name, timer_stats& totals, bool enabled = true)
+        : site(site), name(name), totals(totals)
+    {
+        if(enabled && site.level >= logger::log->level.load(std::memory_order_relaxed))
+            start = timestamp::now();
+    }
+
+    ~scope_timer()
+    {
+        if(!start)
+            return;
+        uint64_t end = timestamp::now();
+        uint64_t elapsed = end > start ? end - start : 0;
+        logging* log = logger::log;
+        if(log->aggregate_timers.load(std::memory_order_relaxed))
+            totals.record(site, name, elapsed);
+        else
+            log->add_log(site, "{} took {} ns", name, elapsed);
+    }
+
+    scope_timer(const scope_timer&) = delete;
+    scope_timer& operator=(const scope_timer&) = delete;
+};
+
+
+/*
+ * Compile time level filtering.
+ *
+ * Define LOGGING_MIN_LEVEL (e.g. -DLOGGING_MIN_LEVEL=LOGGING_LEVEL_INFO) to remove every
+ * LOG_* call below that level from the build, arguments included. Calls at or above it
+ * still go through the runtime level set with set_log_level.
+ */
+#define LOGGING_LEVEL_DEBUG   0
+#define LOGGING_LEVEL_INFO    1
+#define LOGGING_LEVEL_WARNING 2
+#define LOGGING_LEVEL_ERROR   3
+#define LOGGING_LEVEL_FATAL   4
+
+#ifndef LOGGING_MIN_LEVEL
+#define LOGGING_MIN_LEVEL LOGGING_LEVEL_DEBUG
+#endif
+
+/*
+ * Every call site gets a static constexpr logging::log_site with its level, function, file and
+ * line, built by the compiler. The call only passes a pointer to it, the function name is
+ * neither measured nor copied at run time.
+ */
+#define LOGGING_LOG(lvl, ...)                                               \
+    do {                                                                    \
+        static constexpr logging::log_site logging_site_(                   \
+            lvl, __FUNCTION__, __FILE__, __LINE__);                         \
+        if (logger::log->should_log(lvl))                                   \
+            logger::log->add_log(logging_site_, __VA_ARGS__);               \
+    } while (0)
+
+/*
+ * Rate limited logging, for call sites that may fire far more often than anybody can read.
+ * The level is passed as e.g. logging::WARNING. The arguments are only evaluated for the lines
+ * that get through, the others are counted and summarized, see logging::rate_limit.
+ *
+ *   LOG_EVERY_N(lvl, n, ...)                   the first of every n calls
+ *   LOG_EVERY_MS(lvl, ms, ...)                 at most one line every ms milliseconds
+ *   LOG_RATE_LIMITED(lvl, per_second, burst, ...)  a token bucket
+ */
+#if LOGGING_MIN_LEVEL > LOGGING_LEVEL_DEBUG
+#define LOGGING_COMPILED_IN(lvl) (static_cast<int>(lvl) >= LOGGING_MIN_LEVEL)
+#else
+#define LOGGING_COMPILED_IN(lvl) true
+#endif
+
+#define LOGGING_LOG_LIMITED(lvl, allow, ...)                                \
+    do {                                                                    \
+        static constexpr logging::log_site logging_site_(                   \
+            lvl, __FUNCTION__, __FILE__, __LINE__);                         \
+        static logging::rate_limit logging_limit_;                          \
+        if (LOGGING_COMPILED_IN(lvl) &&                                     \
+            logger::log->should_log(lvl) && (allow))                        \
+        {                                                                   \
+            if (logging_limit_.has_suppressed())                            \
+                logger::log->report_suppressed(logging_site_, logging_limit_); \
+            logger::log->add_log(logging_site_, __VA_ARGS__);               \
+        }                                                                   \
+    } while (0)
+
+#define LOG_EVERY_N(lvl, n, ...)                                            \
+    LOGGING_LOG_LIMITED(lvl, logging_limit_.every_n(logging_site_, n), __VA_ARGS__)
+
+#define LOG_EVERY_MS(lvl, ms, ...)                                          \
+    LOGGING_LOG_LIMITED(lvl, logging_limit_.every_ns(logging_site_,         \
+        static_cast<uint64_t>(ms) * 1000000ull, timestamp::now()), __VA_ARGS__)
+
+#define LOG_RATE_LIMITED(lvl, per_second, burst, ...)                       \
+    LOGGING_LOG_LIMITED(lvl, logging_limit_.token_bucket(logging_site_,     \
+        per_second, burst, timestamp::now()), __VA_ARGS__)
+
+/*
+ * Times the rest of the enclosing scope, see logging::scope_timer. When the scope ends the
+ * duration is logged at lvl as "<name> took <n> ns", or with set_timer_aggregation added to a
+ * histogram that is summarized periodically.
+ *
+ *   LOG_SCOPE_TIMER(logging::DEBUG, "parse request");
+ *
+ * The variables are named with __COUNTER__, so several timers can share a scope or a line.
+ */
+#define LOGGING_CONCAT_(a, b) a##b
+#define LOGGING_CONCAT(a, b) LOGGING_CONCAT_(a, b)
+#define LOGGING_SCOPE_TIMER(lvl, name, id)                                  \
+    static constexpr logging::log_site LOGGING_CONCAT(logging_timer_site_, id)( \
+        lvl, __FUNCTION__, __FILE__, __LINE__);                             \
+    static logging::timer_stats LOGGING_CONCAT(logging_timer_stats_, id);   \
+    logging::scope_timer LOGGING_CONCAT(logging_timer_, id)(                \
+        LOGGING_CONCAT(logging_timer_site_, id), name,                      \
+        LOGGING_CONCAT(logging_timer_stats_, id), LOGGING_COMPILED_IN(lvl))
+#define LOG_SCOPE_TIMER(lvl, name) LOGGING_SCOPE_TIMER(lvl, name, __COUNTER__)
+
+#if LOGGING_MIN_LEVEL <= LOGGING_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOGGING_LOG(logging::DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOGGING_MIN_LEVEL <= LOGGING_LEVEL_INFO
+#define LOG_INFO(...) LOGGING_LOG(logging::INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOGGING_MIN_LEVEL <= LOGGING_LEVEL_WARNING
+#define LOG_WARNING(...) LOGGING_LOG(logging::WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) do {} while (0)
+#endif
+
+#if LOGGING_MIN_LEVEL <= LOGGING_LEVEL_ERROR
+#define LOG_ERROR(...) LOGGING_LOG(logging::ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOGGING_MIN_LEVEL <= LOGGING_LEVEL_FATAL
+#define LOG_FATAL(...) LOGGING_LOG(logging::FATAL, __VA_ARGS__)
+#else
+#define LOG_FATAL(...) do {} while (0)
+#endif
+
@@ -0,0 +1,131 @@
+/**
+ * @file logging_alloc_test.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Checks that logging a line does not allocate once the logger is warmed up, in sync
+ *        and async mode, through add_log and the LOG_* macros.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * Usage: logging_alloc_test [--calls=N]
+ *
+ * Replaces the global operator new with one that counts its calls, on every thread, the
+ * writer thread included. Each mode is warmed up first: the first call of a thread creates
+ * its queue and counters and the file buffer is allocated on the first write. Then N calls of
+ * each kind are counted, flush() is left out. The lines go to logging_alloc_test.log, which
+ * is removed at the end. Exits with 1 if anything was allocated.
+ */
+
+#include "logging.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+
+namespace {
+
+std::atomic<bool> counting{false};
+std::atomic<uint64_t> allocations{0};
+
+void* allocate(size_t size, size_t alignment)
+{
+    if(counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* p = alignment > alignof(std::max_align_t)
+                  ? std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1))
+                  : std::malloc(size);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+constexpr const char* log_path = "logging_alloc_test.log";
+const std::string long_message(3 * logging::inline_message_size, 'x');
+
+constexpr size_t chunk = 100;    // rounds between flushes, see countAllocations
+
+/* Logs the rounds first to last, a line of every kind each: string_view, with and without level, deferred and spilled */
+void logLines(size_t first, size_t last)
+{
+    for(size_t i = first; i < last; ++i)
+    {
+        logger::log->add_log(logging::INFO, __FUNCTION__, "plain message");
+        logger::log->add_log(__FUNCTION__, std::string_view(long_message));
+        LOG_INFO("macro message");
+        LOG_WARNING("call {} of {}, {} ms", i, last, 2.5);
+    }
+}
+
+/**
+ * @brief Counts the allocations of calls rounds of logLines.
+ * @return The number of allocations.
+ * @details The rounds are logged in chunks with a flush in between, which is not counted: the
+ *          long messages of a chunk fit in the free buffers a spill_pool keeps, a larger backlog
+ *          of them goes to the global allocator by design. The warm up logs the widest numbers,
+ *          so the buffers the deferred lines are rendered into have their largest size.
+ */
+uint64_t countAllocations(logging::mode mode, size_t calls)
+{
+    logger::log->set_mode(mode);
+    logLines(calls - std::min(calls, chunk), calls);
+    logger::log->flush();
+
+    allocations.store(0);
+    for(size_t first = 0; first < calls; first += chunk)
+    {
+        counting.store(true);
+        logLines(first, std::min(first + chunk, calls));
+        counting.store(false);
+        logger::log->flush();
+    }
+    return allocations.load();
+}
+
+} // namespace
+
+
+void* operator new(size_t size) { return allocate(size, 0); }
+void* operator new[](size_t size) { return allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, static_cast<size_t>(alignment)); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+
+int main(int argc, char* argv[])
+{
+    size_t calls = 100000;
+    for(int i = 1; i < argc; ++i)
+    {
+        char* end = nullptr;
+        if(std::strncmp(argv[i], "--calls=", 8) == 0)
+            calls = std::strtoul(argv[i] + 8, &end, 10);
+        if(!end || *end || calls == 0)
+        {
+            std::cerr << "Usage: " << argv[0] << " [--calls=N]" << std::endl;
+            return 2;
+        }
+    }
+
+    logger::log->set_print_log(false);
+    logger::log->change_log_file(log_path);
+
+    uint64_t sync_allocations = countAllocations(logging::mode::sync, calls);
+    uint64_t async_allocations = countAllocations(logging::mode::async, calls);
+    logger::log->set_mode(logging::mode::sync);
+    std::remove(log_path);
+
+    std::cout << "sync:  " << sync_allocations << " allocations in " << 4 * calls << " lines" << std::endl;
+    std::cout << "async: " << async_allocations << " allocations in " << 4 * calls << " lines" << std::endl;
+    return sync_allocations == 0 && async_allocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+/**
+ * @file logging_bench.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Measures the per call latency and the throughput of add_log for a grid of
+ *        thread counts, sinks, message sizes and modes, and writes the results as JSON.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * Usage: logging_bench [--threads=1,2,4] [--sinks=null,file,console] [--sizes=16,256,4096]
+ *                      [--modes=sync,async] [--calls=N] [--out=results.json]
+ *
+ * Every option takes a comma separated list and defaults to the full grid. --calls is the
+ * number of add_log calls per configuration, split across the threads. The console sink
+ * writes to stdout, redirect it to measure a pipe or a file instead of the terminal.
+ * calls_per_second counts the lines written, enqueue_calls_per_second the add_log calls
+ * returned, which in async mode leaves out the backlog the writer thread still has.
+ */
+
+#include "logging.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+
+namespace {
+
+struct config
+{
+    unsigned threads;
+    std::string sink;
+    size_t size;
+    logging::mode mode;
+};
+
+struct result
+{
+    config cfg;
+    size_t calls;
+    double seconds;                     // until every line is written, flush() included
+    double enqueue_seconds;             // until the last add_log returned, less in async mode
+    uint64_t p50, p99, p999, max;      // ns per call
+};
+
+std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while(std::getline(stream, item, ','))
+        if(!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+/**
+ * @brief Reads a list of numbers.
+ * @param min The smallest number allowed.
+ * @return false if an item is not a number or too small.
+ */
+bool parse_numbers(const std::vector<std::string>& items, size_t min, std::vector<size_t>& numbers)
+{
+    numbers.clear();
+    for(const auto& item : items)
+    {
+        char* end = nullptr;
+        errno = 0;
+        unsigned long long value = std::strtoull(item.c_str(), &end, 10);
+        if(item[0] == '-' || *end || errno || value < min)
+            return false;
+        numbers.push_back(static_cast<size_t>(value));
+    }
+    return !numbers.empty();
+}
+
+bool all_of(const std::vector<std::string>& items, std::initializer_list<const char*> allowed)
+{
+    return !items.empty() && std::all_of(items.begin(), items.end(), [&](const std::string& item)
+    {
+        return std::find(allowed.begin(), allowed.end(), item) != allowed.end();
+    });
+}
+
+uint64_t steady_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * @brief Points the logger at the sink under test.
+ */
+void select_sink(const std::string& sink)
+{
+    logger::log->set_print_log(sink == "console");
+    logger::log->change_log_file(sink == "file" ? "logging_bench.log" : "");
+}
+
+/**
+ * @brief Runs one configuration.
+ * @param cfg The configuration.
+ * @param calls The total number of add_log calls, split across the threads.
+ * @return The latency percentiles and the throughput.
+ * @details The throughput counts the lines written: the clock stops after flush(), so in async
+ *          mode the backlog left in the queues is included. The time until the last add_log
+ *          returned is kept as well.
+ */
+result run(const config& cfg, size_t calls)
+{
+    select_sink(cfg.sink);
+    logger::log->set_mode(cfg.mode);
+
+    std::string message(cfg.size, 'x');
+    size_t per_thread = std::max<size_t>(1, calls / cfg.threads);
+    std::vector<std::vector<uint64_t>> latencies(cfg.threads, std::vector<uint64_t>(per_thread));
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < cfg.threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::vector<uint64_t>& samples = latencies[t];
+            ready.fetch_add(1);
+            while(!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            for(size_t i = 0; i < per_thread; ++i)
+            {
+                uint64_t start = steady_ns();
+                logger::log->add_log(logging::INFO, "bench", message);
+                samples[i] = steady_ns() - start;
+            }
+        });
+    }
+
+    while(ready.load() != cfg.threads)
+        std::this_thread::yield();
+    uint64_t start = steady_ns();
+    go.store(true, std::memory_order_release);
+    for(auto& thread : threads)
+        thread.join();
+    uint64_t enqueued = steady_ns() - start;
+    logger::log->flush();
+    uint64_t elapsed = steady_ns() - start;
+
+    std::vector<uint64_t> all;
+    all.reserve(per_thread * cfg.threads);
+    for(const auto& samples : latencies)
+        all.insert(all.end(), samples.begin(), samples.end());
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&all](double p)
+    {
+        return all[std::min(all.size() - 1, static_cast<size_t>(p * static_cast<double>(all.size())))];
+    };
+    return result{cfg, all.size(), static_cast<double>(elapsed) / 1e9, static_cast<double>(enqueued) / 1e9,
+                  percentile(0.50), percentile(0.99), percentile(0.999), all.back()};
+}
+
+void write_json(std::ostream& out, const std::vector<result>& results)
+{
+    out << "{\n  \"benchmark\": \"logging_bench\",\n  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const result& r = results[i];
+        out << "    {\"threads\": " << r.cfg.threads
+            << ", \"sink\": \"" << r.cfg.sink << "\""
+            << ", \"message_size\": " << r.cfg.size
+            << ", \"mode\": \"" << (r.cfg.mode == logging::mode::async ? "async" : "sync") << "\""
+            << ", \"calls\": " << r.calls
+            << ", \"seconds\": " << r.seconds
+            << ", \"calls_per_second\": " << static_cast<uint64_t>(static_cast<double>(r.calls) / r.seconds)
+            << ", \"enqueue_seconds\": " << r.enqueue_seconds
+            << ", \"enqueue_calls_per_second\": "
+            << static_cast<uint64_t>(static_cast<double>(r.calls) / r.enqueue_seconds)
+            << ", \"latency_ns\": {\"p50\": " << r.p50 << ", \"p99\": " << r.p99
+            << ", \"p99.9\": " << r.p999 << ", \"max\": " << r.max << "}}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> thread_list = split("1,2,4,8,16,32,64");
+    std::vector<std::string> sinks = split("null,file,console");
+    std::vector<std::string> sizes = split("16,64,256,1024,4096");
+    std::vector<std::string> modes = split("sync,async");
+    size_t calls = 200000;
+    std::string out_path = "logging_bench.json";
+    auto usage = [&]()
+    {
+        std::cerr << "Usage: " << argv[0] << " [--threads=1,2,4] [--sinks=null,file,console]"
+                  << " [--sizes=16,256,4096] [--modes=sync,async] [--calls=N] [--out=results.json]" << std::endl;
+        return 2;
+    };
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto value = [&arg](const char* name) -> const char*
+        {
+            size_t length = std::strlen(name);
+            return arg.compare(0, length, name) == 0 ? arg.c_str() + length : nullptr;
+        };
+
+        if(const char* v = value("--threads="))
+            thread_list = split(v);
+        else if(const char* v = value("--sinks="))
+            sinks = split(v);
+        else if(const char* v = value("--sizes="))
+            sizes = split(v);
+        else if(const char* v = value("--modes="))
+            modes = split(v);
+        else if(const char* v = value("--calls="))
+        {
+            std::vector<size_t> number;
+            if(!parse_numbers({v}, 1, number))
+                return usage();
+            calls = number[0];
+        }
+        else if(const char* v = value("--out="))
+            out_path = v;
+        else
+            return usage();
+    }
+
+    std::vector<size_t> thread_counts, message_sizes;
+    if(!parse_numbers(thread_list, 1, thread_counts) || !parse_numbers(sizes, 0, message_sizes) ||
+       !all_of(sinks, {"null", "file", "console"}) || !all_of(modes, {"sync", "async"}))
+        return usage();
+
+    // Nothing below the benchmark level may be filtered away
+    logger::log->set_log_level(logging::DEBUG);
+
+    std::vector<result> results;
+    for(const auto& mode : modes)
+        for(const auto& sink : sinks)
+            for(size_t size : message_sizes)
+                for(size_t threads : thread_counts)
+                {
+                    config cfg{static_cast<unsigned>(threads), sink, size,
+                               mode == "async" ? logging::mode::async : logging::mode::sync};
+                    results.push_back(run(cfg, calls));
+
+                    const result& r = results.back();
+                    std::cerr << mode << " " << sink << " " << size << "B x" << threads << ": "
+                              << static_cast<uint64_t>(static_cast<double>(r.calls) / r.seconds) << " calls/s ("
+                              << static_cast<uint64_t>(static_cast<double>(r.calls) / r.enqueue_seconds)
+                              << " enqueued), p50 "
+                              << r.p50 << " ns, p99 " << r.p99 << " ns, p99.9 " << r.p999 << " ns, max "
+                              << r.max << " ns" << std::endl;
+                }
+
+    select_sink("null");
+    ::unlink("logging_bench.log");
+
+    std::ofstream out(out_path);
+    write_json(out, results);
+    if(!out)
+    {
+        std::cerr << "Can't write " << out_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+/**
+ * @file logquery.cpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Prints the lines of a text log file in a time range, at a minimum level or from
+ *        one function, reading only the blocks its index says can hold them.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * Usage: logquery [--from=TIME] [--to=TIME] [--level=LEVEL] [--function=NAME] <file.log>
+ * TIME is local time, YYYY-mm-ddTHH:MM:SS[.fff] or HH:MM:SS[.fff] on the day of the last indexed
+ * line. LEVEL keeps that level and the ones above it, like logging::set_log_level. The lines go
+ * to the standard output. The index is <file.log>.idx, see logging::set_file_index and
+ * log_index.hpp; the parts of the file it does not cover are scanned line by line.
+ */
+
+#include "logging.hpp"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <strings.h>
+#include <sys/mman.h>
+#include <vector>
+
+
+namespace {
+
+constexpr uint64_t ns_per_second = 1000000000ull;
+constexpr size_t level_at = 1 + logging::field_width + 3;           // see formatHeader
+constexpr size_t function_at = level_at + logging::field_width + 3;
+constexpr const char* level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR", "FATAL", "UNKNOWN"};
+constexpr uint32_t all_levels = (1u << logging::level_count) - 1;
+
+struct query
+{
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint32_t levels = all_levels;   // bit 1 << level of every level kept
+    std::string function;           // cut to the field width, empty for any
+};
+
+/* A part of the log file and what its lines can hold */
+struct range
+{
+    uint64_t begin;
+    uint64_t end;
+    uint64_t min_time;
+    uint64_t max_time;
+    uint32_t levels;
+    uint64_t day_hint;              // a time on the day of its first line
+};
+
+/* The local midnight at or before a time, in ns since epoch */
+uint64_t dayStart(uint64_t time)
+{
+    std::time_t seconds = static_cast<std::time_t>(time / ns_per_second);
+    std::tm time_info;
+    localtime_r(&seconds, &time_info);
+    time_info.tm_hour = 0;
+    time_info.tm_min = 0;
+    time_info.tm_sec = 0;
+    time_info.tm_isdst = -1;
+    return static_cast<uint64_t>(std::mktime(&time_info)) * ns_per_second;
+}
+
+/**
+ * @brief Reads HH:MM:SS with an optional fraction.
+ * @param ns The time since midnight.
+ * @param unit Set to the ns of the last digit, if not nullptr.
+ * @return The number of characters read, 0 if the text is not a time.
+ */
+size_t parseTimeOfDay(const char* p, const char* end, uint64_t& ns, uint64_t* unit = nullptr)
+{
+    const char* start = p;
+    auto number = [&](uint64_t& value)
+    {
+        value = 0;
+        for(int i = 0; i < 2; ++i, ++p)
+        {
+            if(p >= end || *p < '0' || *p > '9')
+                return false;
+            value = value * 10 + static_cast<uint64_t>(*p - '0');
+        }
+        return true;
+    };
+
+    uint64_t hours, minutes, seconds;
+    if(!number(hours) || p >= end || *p++ != ':' || !number(minutes) || p >= end || *p++ != ':' ||
+       !number(seconds))
+        return 0;
+    ns = ((hours * 60 + minutes) * 60 + seconds) * ns_per_second;
+
+    uint64_t last = ns_per_second;
+    if(p < end && *p == '.')
+    {
+        ++p;
+        for(uint64_t scale = ns_per_second / 10; p < end && *p >= '0' && *p <= '9'; ++p, scale /= 10)
+        {
+            ns += static_cast<uint64_t>(*p - '0') * scale;
+            last = scale ? scale : 1;
+        }
+    }
+    if(unit)
+        *unit = last;
+    return static_cast<size_t>(p - start);
+}
+
+/**
+ * @brief Reads a --from or --to time.
+ * @param reference A time on the day a time without a date is on.
+ * @param until Whether the time ends the range, it then takes in the whole unit of its last digit
+ *        like the lines printed with that time: 10:15:00.250 is up to 10:15:00.250999999.
+ * @return false if the text is not a time.
+ */
+bool parseTime(const char* text, uint64_t reference, bool until, uint64_t& time)
+{
+    const char* end = text + std::strlen(text);
+    int year, month, day, used = 0;
+    uint64_t day_start;
+    if(std::sscanf(text, "%4d-%2d-%2d%n", &year, &month, &day, &used) == 3 && used == 10 &&
+       (text[10] == 'T' || text[10] == ' '))
+    {
+        std::tm time_info{};
+        time_info.tm_year = year - 1900;
+        time_info.tm_mon = month - 1;
+        time_info.tm_mday = day;
+        time_info.tm_isdst = -1;
+        day_start = static_cast<uint64_t>(std::mktime(&time_info)) * ns_per_second;
+        text += 11;
+    }
+    else
+    {
+        day_start = dayStart(reference);
+    }
+
+    uint64_t of_day, unit;
+    if(parseTimeOfDay(text, end, of_day, &unit) != static_cast<size_t>(end - text))
+        return false;
+    time = day_start + of_day + (until ? unit - 1 : 0);
+    return true;
+}
+
+bool parseLevel(const char* text, uint32_t& levels)
+{
+    for(size_t i = 0; i < logging::level_count; ++i)
+    {
+        if(strcasecmp(text, level_names[i]) == 0)
+        {
+            levels = all_levels & ~((1u << i) - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string_view trimmed(std::string_view field)
+{
+    size_t length = field.find_last_not_of(' ');
+    return field.substr(0, length == std::string_view::npos ? 0 : length + 1);
+}
+
+/**
+ * @brief Writes the lines of a range that match the query.
+ * @param check_time Whether the times of the lines are checked, the range may hold lines outside the query.
+ * @param check_level Whether the levels of the lines are checked.
+ */
+void scanRange(const char* data, const range& part, const query& wanted, bool check_time, bool check_level)
+{
+    uint64_t day = dayStart(part.day_hint);
+    uint64_t last_of_day = 0;
+    const char* p = data + part.begin;
+    const char* end = data + part.end;
+    while(p < end)
+    {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char* next = newline ? newline + 1 : end;
+        std::string_view line(p, static_cast<size_t>(next - p));
+        p = next;
+
+        // Lines without a text header, e.g. the rest of a multi-line message, only pass without checks
+        if(line.size() < log_header_length || line[0] != '[')
+        {
+            if(!check_time && !check_level && wanted.function.empty())
+                std::fwrite(line.data(), 1, line.size(), stdout);
+            continue;
+        }
+
+        if(check_level)
+        {
+            std::string_view name = trimmed(line.substr(level_at, logging::field_width));
+            size_t level = 0;
+            while(level < logging::level_count && name != level_names[level])
+                ++level;
+            if(level == logging::level_count || !(wanted.levels & (1u << level)))
+                continue;
+        }
+
+        if(!wanted.function.empty() && trimmed(line.substr(function_at, logging::field_width)) != wanted.function)
+            continue;
+
+        if(check_time)
+        {
+            uint64_t of_day;
+            if(!parseTimeOfDay(line.data() + 1, line.data() + 1 + logging::field_width, of_day))
+                continue;
+            // The lines are about in time order, a time far before the last one is on the next day
+            if(of_day + 12 * 3600 * ns_per_second < last_of_day)
+                day = dayStart(day + 30 * 3600 * ns_per_second);
+            last_of_day = of_day;
+            uint64_t time = day + of_day;
+            if(time < wanted.from || time > wanted.to)
+                continue;
+        }
+
+        std::fwrite(line.data(), 1, line.size(), stdout);
+    }
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+    const char* path = nullptr;
+    const char* from = nullptr;
+    const char* to = nullptr;
+    query wanted;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strncmp(argv[i], "--from=", 7) == 0)
+            from = argv[i] + 7;
+        else if(std::strncmp(argv[i], "--to=", 5) == 0)
+            to = argv[i] + 5;
+        else if(std::strncmp(argv[i], "--function=", 11) == 0)
+            wanted.function = std::string(argv[i] + 11).substr(0, logging::field_width);
+        else if(std::strncmp(argv[i], "--level=", 8) == 0)
+        {
+            if(!parseLevel(argv[i] + 8, wanted.levels))
+            {
+                std::cerr << "Unknown log level " << argv[i] + 8 << std::endl;
+                return 2;
+            }
+        }
+        else
+            path = argv[i];
+    }
+
+    if(!path)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--from=TIME] [--to=TIME] [--level=LEVEL] [--function=NAME] <file.log>"
+                  << std::endl;
+        return 2;
+    }
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || ::fstat(fd, &info) != 0)
+    {
+        std::cerr << "Can't open log file " << path << std::endl;
+        return 1;
+    }
+    uint64_t size = static_cast<uint64_t>(info.st_size);
+    if(size == 0)
+        return 0;
+    void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED)
+    {
+        std::cerr << "Can't map log file " << path << std::endl;
+        return 1;
+    }
+    const char* data = static_cast<const char*>(map);
+
+    // A missing or foreign index leaves the whole file uncovered
+    std::ifstream index_file(std::string(path) + log_index::suffix, std::ios::binary);
+    std::string index((std::istreambuf_iterator<char>(index_file)), std::istreambuf_iterator<char>());
+    log_index::header head{};
+    if(index.size() >= sizeof(head))
+        std::memcpy(&head, index.data(), sizeof(head));
+    if(std::memcmp(head.magic, log_index::magic, sizeof(log_index::magic)) != 0 || head.version != log_index::version)
+        index.clear();
+
+    std::vector<range> parts;
+    uint64_t covered = 0;
+    uint64_t last_time = static_cast<uint64_t>(info.st_mtime) * ns_per_second;
+    for(size_t at = sizeof(head); at + sizeof(log_index::entry) <= index.size(); at += sizeof(log_index::entry))
+    {
+        log_index::entry block;
+        std::memcpy(&block, index.data() + at, sizeof(block));
+        if(block.offset < covered || block.offset >= size)
+            continue;
+        if(block.offset > covered)
+            parts.push_back({covered, block.offset, 0, UINT64_MAX, all_levels, block.min_time});
+        covered = std::min(block.offset + block.length, size);
+        parts.push_back({block.offset, covered, block.min_time, block.max_time, block.levels, block.min_time});
+        last_time = block.max_time;
+    }
+    if(covered < size)
+        parts.push_back({covered, size, 0, UINT64_MAX, all_levels, last_time});
+
+    if((from && !parseTime(from, last_time, false, wanted.from)) || (to && !parseTime(to, last_time, true, wanted.to)))
+    {
+        std::cerr << "A time is YYYY-mm-ddTHH:MM:SS[.fff] or HH:MM:SS[.fff]" << std::endl;
+        return 2;
+    }
+
+    // Only the blocks that can match are read. Asking for all of them first lets the reads overlap
+    auto selected = [&](const range& part)
+    {
+        return (part.levels & wanted.levels) && part.max_time >= wanted.from && part.min_time <= wanted.to;
+    };
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    for(const range& part : parts)
+    {
+        if(!selected(part))
+            continue;
+        uint64_t begin = part.begin & ~static_cast<uint64_t>(page - 1);
+        ::madvise(const_cast<char*>(data) + begin, part.end - begin, MADV_WILLNEED);
+    }
+
+    static char output[1 << 20];
+    std::setvbuf(stdout, output, _IOFBF, sizeof(output));
+    for(const range& part : parts)
+    {
+        if(!selected(part))
+            continue;
+        bool check_time = part.min_time < wanted.from || part.max_time > wanted.to;
+        bool check_level = (part.levels & ~wanted.levels) != 0;
+        if(!check_time && !check_level && wanted.function.empty())
+            std::fwrite(data + part.begin, 1, part.end - part.begin, stdout);
+        else
+            scanRange(data, part, wanted, check_time, check_level);
+    }
+    std::fflush(stdout);
+    ::munmap(map, size);
+    return 0;
+}
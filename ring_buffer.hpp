@@ -0,0 +1,175 @@
+/**
+ * @file ring_buffer.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Bounded lock-free ring buffer used to hand log records from the
+ *        producing threads to the background writer thread.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/**
+ * @brief Bounded multi-producer ring buffer (D. Vyukov's sequence based queue).
+ *
+ * Every slot carries a sequence number which tells producers and consumers
+ * whether the slot is free or holds a published element, so neither side
+ * needs a lock. The logger uses it with many producers and one writer thread,
+ * but try_pop() is also safe from producers, which is what the drop-oldest
+ * overflow policy relies on.
+ */
+template <typename T>
+class ring_buffer
+{
+private:
+    static constexpr size_t cache_line = 64;
+
+    struct slot
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+    alignas(cache_line) std::atomic<size_t> enqueue_pos{0};
+    alignas(cache_line) std::atomic<size_t> dequeue_pos{0};
+
+public:
+    /**
+     * @brief Constructs a ring buffer.
+     * @param capacity Number of slots, rounded up to the next power of two.
+     */
+    explicit ring_buffer(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        slots.reset(new slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ring_buffer(const ring_buffer&) = delete;
+    ring_buffer& operator=(const ring_buffer&) = delete;
+
+    /* The memory of the slots, e.g. to move it to another NUMA node */
+    const void* storage() const { return slots.get(); }
+    size_t storage_size() const { return (mask + 1) * sizeof(slot); }
+
+    /**
+     * @brief Reserves a slot and fills it in place, if there is room.
+     * @param fill Called with the slot's element before it is published to the consumer.
+     * @return false if the buffer is full, fill is not called then.
+     */
+    template <typename F>
+    bool try_emplace(F&& fill)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            slot& s = slots[pos & mask];
+            size_t seq = s.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    fill(s.data);
+                    s.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Hands the oldest element to a callback in place and frees its slot.
+     * @param use Called with the element, the slot is reused once it returns.
+     * @return false if the buffer is empty.
+     */
+    template <typename F>
+    bool try_consume(F&& use)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            slot& s = slots[pos & mask];
+            size_t seq = s.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    use(s.data);
+                    s.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Pushes an element if there is room for it.
+     * @param value The element, moved from only on success.
+     * @return false if the buffer is full.
+     */
+    bool try_push(T& value)
+    {
+        return try_emplace([&value](T& data) { data = std::move(value); });
+    }
+
+    /**
+     * @brief Pops the oldest element if there is one.
+     * @param value Receives the element.
+     * @return false if the buffer is empty.
+     */
+    bool try_pop(T& value)
+    {
+        return try_consume([&value](T& data) { value = std::move(data); });
+    }
+
+    /**
+     * @brief Approximate number of queued elements.
+     */
+    size_t size() const
+    {
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    /**
+     * @brief Number of elements ever pushed, and popped. Both only grow.
+     */
+    size_t pushed() const { return enqueue_pos.load(std::memory_order_acquire); }
+    size_t popped() const { return dequeue_pos.load(std::memory_order_acquire); }
+
+    size_t capacity() const { return mask + 1; }
+};
@@ -0,0 +1,153 @@
+/**
+ * @file spill_pool.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Per-thread pools of the buffers that hold the messages too long to be
+ *        stored inline in a queued log record.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/**
+ * @brief Size class buffers for long messages, recycled without the global allocator.
+ *
+ * A logging thread takes its buffers from a pool of its own, in size classes of 256 bytes to
+ * 64 KiB. The thread that writes the record gives the buffer back to the free list of that pool
+ * with one compare and swap, so the threads never meet in malloc and only the pool's owner pops.
+ * Each class keeps up to max_cached_bytes of free buffers, what is given back beyond that and
+ * messages larger than the largest class go to the global allocator. Like the reader records of
+ * epoch, a pool is never freed: a thread that exits hands its pool to the next new thread, and
+ * buffers still in flight return to it.
+ */
+class spill_pool
+{
+public:
+    static constexpr size_t min_size = 256;
+    static constexpr size_t class_count = 9;                // 256 B to 64 KiB
+    static constexpr size_t max_size = min_size << (class_count - 1);
+    static constexpr size_t max_cached_bytes = 256 * 1024;  // free buffers kept per class
+
+private:
+    struct alignas(16) block
+    {
+        block* next;
+        spill_pool* owner;              // nullptr for a message larger than max_size
+        uint32_t size_class;
+    };
+
+    std::atomic<block*> free_blocks[class_count]{};
+    std::atomic<uint32_t> cached[class_count]{};
+    std::atomic<bool> in_use{true};
+    spill_pool* next_pool = nullptr;
+
+    static std::atomic<spill_pool*>& pools()
+    {
+        static std::atomic<spill_pool*> head{nullptr};
+        return head;
+    }
+
+    static spill_pool* acquire_pool()
+    {
+        for (spill_pool* p = pools().load(std::memory_order_acquire); p; p = p->next_pool)
+        {
+            bool expected = false;
+            if (!p->in_use.load(std::memory_order_relaxed) &&
+                p->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return p;
+        }
+
+        spill_pool* p = new spill_pool;
+        p->next_pool = pools().load(std::memory_order_relaxed);
+        while (!pools().compare_exchange_weak(p->next_pool, p, std::memory_order_release,
+                                              std::memory_order_relaxed))
+            ;
+        return p;
+    }
+
+    struct thread_pool
+    {
+        spill_pool* pool = acquire_pool();
+        ~thread_pool() { pool->in_use.store(false, std::memory_order_release); }
+    };
+
+    static spill_pool* local()
+    {
+        static thread_local thread_pool p;
+        return p.pool;
+    }
+
+    static constexpr size_t class_bytes(uint32_t size_class) { return min_size << size_class; }
+
+    static uint32_t class_of(size_t size)
+    {
+        uint32_t size_class = 0;
+        while (class_bytes(size_class) < size)
+            ++size_class;
+        return size_class;
+    }
+
+    static char* data_of(block* b) { return reinterpret_cast<char*>(b + 1); }
+
+public:
+    /**
+     * @brief Takes a buffer of at least size bytes from the calling thread's pool.
+     */
+    static char* allocate(size_t size)
+    {
+        if (size > max_size)
+        {
+            block* b = static_cast<block*>(::operator new(sizeof(block) + size));
+            b->owner = nullptr;
+            return data_of(b);
+        }
+
+        spill_pool* pool = local();
+        uint32_t size_class = class_of(size);
+        std::atomic<block*>& list = pool->free_blocks[size_class];
+
+        // Only the owner pops, so the head can't be popped and pushed again in between (no ABA)
+        block* b = list.load(std::memory_order_acquire);
+        while (b && !list.compare_exchange_weak(b, b->next, std::memory_order_acquire, std::memory_order_acquire))
+            ;
+        if (b)
+        {
+            pool->cached[size_class].fetch_sub(1, std::memory_order_relaxed);
+            return data_of(b);
+        }
+
+        b = static_cast<block*>(::operator new(sizeof(block) + class_bytes(size_class)));
+        b->owner = pool;
+        b->size_class = size_class;
+        return data_of(b);
+    }
+
+    /**
+     * @brief Gives a buffer back to the pool it came from. May be called from any thread.
+     */
+    static void release(char* data)
+    {
+        block* b = reinterpret_cast<block*>(data) - 1;
+        spill_pool* pool = b->owner;
+        if (!pool || pool->cached[b->size_class].load(std::memory_order_relaxed) * class_bytes(b->size_class) >=
+                     max_cached_bytes)
+        {
+            ::operator delete(b);
+            return;
+        }
+
+        pool->cached[b->size_class].fetch_add(1, std::memory_order_relaxed);
+        std::atomic<block*>& list = pool->free_blocks[b->size_class];
+        b->next = list.load(std::memory_order_relaxed);
+        while (!list.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+};
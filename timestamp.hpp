@@ -0,0 +1,232 @@
+/**
+ * @file timestamp.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Clock sources and an allocation free "HH:MM:SS.mmm" formatter for the
+ *        log line timestamps.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LOGGING_HAVE_TSC 1
+#endif
+
+class timestamp
+{
+public:
+    /* enum class clock_source: where now() reads the time from */
+    enum class clock_source: uint8_t
+    {
+        realtime,           // clock_gettime(CLOCK_REALTIME)
+        realtime_coarse,    // clock_gettime(CLOCK_REALTIME_COARSE), a few ms resolution but very cheap
+        tsc                 // rdtsc scaled against the wall clock, falls back to realtime without a TSC
+    };
+
+    /* enum class precision: number of fraction digits written by format() */
+    enum class precision: uint8_t
+    {
+        milliseconds,       // HH:MM:SS.mmm
+        microseconds        // HH:MM:SS.uuuuuu
+    };
+
+    static constexpr size_t max_length = 15;
+
+private:
+    struct tsc_calibration
+    {
+        uint64_t base_tsc;
+        uint64_t base_ns;
+        uint64_t mult;      // ns per tick as 32.32 fixed point
+    };
+
+    static std::atomic<clock_source>& source()
+    {
+        static std::atomic<clock_source> value{clock_source::realtime};
+        return value;
+    }
+
+    static tsc_calibration& calibration()
+    {
+        static tsc_calibration value{0, 0, 0};
+        return value;
+    }
+
+    static uint64_t read_clock(clockid_t id)
+    {
+        timespec ts;
+        clock_gettime(id, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    /* The UTC offset in seconds format() last saw, for format_signal_safe() */
+    static std::atomic<long>& utc_offset()
+    {
+        static std::atomic<long> value{0};
+        return value;
+    }
+
+    static char* write_2digits(char* out, unsigned value)
+    {
+        out[0] = static_cast<char>('0' + value / 10);
+        out[1] = static_cast<char>('0' + value % 10);
+        return out + 2;
+    }
+
+    static void write_hms(char* out, unsigned hours, unsigned minutes, unsigned seconds)
+    {
+        char* p = write_2digits(out, hours);
+        *p++ = ':';
+        p = write_2digits(p, minutes);
+        *p++ = ':';
+        write_2digits(p, seconds);
+    }
+
+    /* Writes HH:MM:SS and the fraction digits of ns */
+    static size_t write_time(uint64_t ns, const char* hms, char* out, precision digits)
+    {
+        for(size_t i = 0; i < 8; ++i)
+            out[i] = hms[i];
+        out[8] = '.';
+
+        uint32_t fraction = static_cast<uint32_t>(ns % 1000000000ull);
+        int count = 3;
+        if(digits == precision::microseconds)
+        {
+            fraction /= 1000;
+            count = 6;
+        }
+        else
+        {
+            fraction /= 1000000;
+        }
+        for(int i = count; i > 0; --i)
+        {
+            out[8 + i] = static_cast<char>('0' + fraction % 10);
+            fraction /= 10;
+        }
+        return 9 + static_cast<size_t>(count);
+    }
+
+public:
+    /**
+     * @brief Select the clock used by now().
+     * @param new_source The new clock source.
+     * @details Selecting tsc measures the TSC frequency against CLOCK_REALTIME, which
+     *          blocks the caller for about 10 ms. The TSC is assumed to be invariant.
+     */
+    static void set_clock_source(clock_source new_source)
+    {
+#ifdef LOGGING_HAVE_TSC
+        // Calibrate once, readers may be using the calibration already
+        if(new_source == clock_source::tsc && source().load(std::memory_order_acquire) != clock_source::tsc)
+        {
+            uint64_t tsc0 = __rdtsc();
+            uint64_t ns0 = read_clock(CLOCK_REALTIME);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            uint64_t tsc1 = __rdtsc();
+            uint64_t ns1 = read_clock(CLOCK_REALTIME);
+
+            tsc_calibration& cal = calibration();
+            cal.base_tsc = tsc1;
+            cal.base_ns = ns1;
+            cal.mult = tsc1 > tsc0 ? ((ns1 - ns0) << 32) / (tsc1 - tsc0) : 0;
+            if(cal.mult == 0)
+                new_source = clock_source::realtime;
+        }
+#else
+        if(new_source == clock_source::tsc)
+            new_source = clock_source::realtime;
+#endif
+        source().store(new_source, std::memory_order_release);
+    }
+
+    static clock_source get_clock_source()
+    {
+        return source().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the current wall clock time.
+     * @return Nanoseconds since the Unix epoch.
+     */
+    static uint64_t now()
+    {
+        switch (source().load(std::memory_order_acquire))
+        {
+#ifdef LOGGING_HAVE_TSC
+            case clock_source::tsc:
+            {
+                const tsc_calibration& cal = calibration();
+                uint64_t delta = __rdtsc() - cal.base_tsc;
+                return cal.base_ns + static_cast<uint64_t>((static_cast<unsigned __int128>(delta) * cal.mult) >> 32);
+            }
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+            case clock_source::realtime_coarse:
+                return read_clock(CLOCK_REALTIME_COARSE);
+#endif
+            default:
+                return read_clock(CLOCK_REALTIME);
+        }
+    }
+
+    /**
+     * @brief Write a time as HH:MM:SS.mmm (or HH:MM:SS.uuuuuu) in local time.
+     * @param ns Nanoseconds since the Unix epoch, as returned by now().
+     * @param out Destination, at least max_length bytes. No terminating null is written.
+     * @param digits Number of fraction digits.
+     * @return The number of characters written.
+     *
+     * The HH:MM:SS part is cached per thread and only recomputed with localtime_r when the
+     * second changes, every other call just rewrites the fraction digits.
+     */
+    static size_t format(uint64_t ns, char* out, precision digits = precision::milliseconds)
+    {
+        struct cache
+        {
+            int64_t second = -1;
+            char hms[8];
+        };
+        static thread_local cache cached;
+
+        int64_t second = static_cast<int64_t>(ns / 1000000000ull);
+        if(second != cached.second)
+        {
+            std::time_t t = static_cast<std::time_t>(second);
+            std::tm time_info;
+            localtime_r(&t, &time_info);
+            write_hms(cached.hms, static_cast<unsigned>(time_info.tm_hour), static_cast<unsigned>(time_info.tm_min),
+                      static_cast<unsigned>(time_info.tm_sec));
+            cached.second = second;
+            utc_offset().store(time_info.tm_gmtoff, std::memory_order_relaxed);
+        }
+        return write_time(ns, cached.hms, out, digits);
+    }
+
+    /**
+     * @brief Like format(), but async-signal-safe, for the crash handler.
+     * @details localtime_r may take a lock and allocate, so the local time is the UTC time plus the
+     *          UTC offset the last format() call saw. It is off by the change if the offset changed
+     *          since, e.g. to daylight saving time.
+     */
+    static size_t format_signal_safe(uint64_t ns, char* out, precision digits = precision::milliseconds)
+    {
+        int64_t local = static_cast<int64_t>(ns / 1000000000ull) + utc_offset().load(std::memory_order_relaxed);
+        unsigned of_day = static_cast<unsigned>((local % 86400 + 86400) % 86400);
+        char hms[8];
+        write_hms(hms, of_day / 3600, of_day / 60 % 60, of_day % 60);
+        return write_time(ns, hms, out, digits);
+    }
+};
@@ -0,0 +1,358 @@
+/**
+ * @file uring_writer.hpp
+ * @author adem marangoz (adem.marangoz95@gmail.com)
+ * @brief Writes the batches of the log file writer through io_uring, so the writer
+ *        thread keeps filling the next batch while the previous one is written.
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#define LOGGING_HAVE_URING 1
+#endif
+
+#if LOGGING_HAVE_URING
+
+/**
+ * @brief Triple buffered writes to a file opened with O_APPEND, submitted to an io_uring.
+ *
+ * The caller fills buffer() and hands it over with submit(), which returns right away with the
+ * next buffer unless all of them are still waiting to be written. Only one write is in flight at
+ * a time: the kernel may run writes in flight together in any order, and the lines of the file
+ * must stay in order. The buffers are registered with the ring and written with
+ * IORING_OP_WRITE_FIXED, or with IORING_OP_WRITEV if registering fails. The ring is set up with
+ * the raw system calls, liburing is not needed. If the kernel rejects a write the rest is written
+ * with write(2). Not thread-safe, used by the writer thread only.
+ */
+class uring_writer
+{
+public:
+    static constexpr unsigned buffer_count = 3;     // one in flight, one waiting, one being filled
+
+private:
+    int ring_fd = -1;
+    int fd;
+    size_t buffer_size;
+    char* buffers[buffer_count]{};
+    size_t lengths[buffer_count]{};
+    iovec vectors[buffer_count]{};
+    unsigned filling = 0;               // the buffer the caller fills
+    unsigned queued = 0;                // full buffers before it, the oldest is in flight
+    bool in_flight = false;
+    bool fixed = false;                 // the buffers are registered with the ring
+    bool failed = false;                // the kernel rejected a write, write(2) from now on
+
+    void* sq_map = MAP_FAILED;
+    size_t sq_map_size = 0;
+    void* cq_map = MAP_FAILED;
+    size_t cq_map_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    uring_writer(int fd, size_t buffer_size) : fd(fd), buffer_size(buffer_size) {}
+
+    bool setup()
+    {
+        io_uring_params params{};
+        ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, 4, &params));
+        if (ring_fd < 0)
+            return false;
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_map_size = cq_map_size = sq_map_size > cq_map_size ? sq_map_size : cq_map_size;
+
+        sq_map = ::mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED)
+            return false;
+        cq_map = single ? sq_map : ::mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          ring_fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED)
+            return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        char* sq = static_cast<char*>(sq_map);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        char* cq = static_cast<char*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        for (unsigned i = 0; i < buffer_count; ++i)
+        {
+            buffers[i] = static_cast<char*>(std::aligned_alloc(4096, (buffer_size + 4095) & ~size_t(4095)));
+            if (!buffers[i])
+                return false;
+            vectors[i] = {buffers[i], buffer_size};
+        }
+        fixed = ::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, vectors, buffer_count) == 0;
+        return true;
+    }
+
+    unsigned oldest() const { return (filling + buffer_count - queued) % buffer_count; }
+
+    void write_all(const char* data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    /* Writes the full buffers with write(2), oldest first */
+    void write_queued()
+    {
+        for (; queued; --queued)
+            write_all(buffers[oldest()], lengths[oldest()]);
+    }
+
+    /* Submits the oldest full buffer. The file is opened with O_APPEND, so the offset is ignored */
+    void start_write()
+    {
+        unsigned index = oldest();
+        unsigned tail = *sq_tail;
+        unsigned slot = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[slot];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->off = 0;
+        if (fixed)
+        {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = reinterpret_cast<uint64_t>(buffers[index]);
+            sqe->len = static_cast<uint32_t>(lengths[index]);
+            sqe->buf_index = static_cast<uint16_t>(index);
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_WRITEV;
+            vectors[index].iov_len = lengths[index];
+            sqe->addr = reinterpret_cast<uint64_t>(&vectors[index]);
+            sqe->len = 1;
+        }
+        sqe->user_data = index;
+        sq_array[slot] = slot;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        long submitted;
+        do
+            submitted = ::syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+        while (submitted < 0 && errno == EINTR);
+        if (submitted < 1)
+        {
+            failed = true;
+            write_queued();
+            return;
+        }
+        in_flight = true;
+    }
+
+    /**
+     * @brief Takes the completion of the write in flight.
+     * @param wait Whether to wait for it.
+     * @return Whether no write is in flight any more.
+     */
+    bool reap(bool wait)
+    {
+        if (!in_flight)
+            return true;
+
+        unsigned head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (!wait)
+                return false;
+            if (::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR)
+            {
+                // The completion can't be waited for, better a line twice than a lost batch
+                in_flight = false;
+                failed = true;
+                write_queued();
+                return true;
+            }
+        }
+
+        const io_uring_cqe& done = cqes[head & cq_mask];
+        unsigned index = static_cast<unsigned>(done.user_data);
+        int result = done.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        in_flight = false;
+
+        size_t written = result > 0 ? static_cast<size_t>(result) : 0;
+        if (written < lengths[index])
+            write_all(buffers[index] + written, lengths[index] - written);
+        --queued;
+        if (result < 0)
+        {
+            failed = true;
+            write_queued();
+        }
+        return true;
+    }
+
+public:
+    /**
+     * @brief Sets up a ring and its buffers for a file.
+     * @param fd The file, opened with O_APPEND. It must outlive the writer.
+     * @param buffer_size The size of each buffer.
+     * @return The writer, or nullptr if the kernel has no io_uring or it is not allowed.
+     */
+    static std::unique_ptr<uring_writer> create(int fd, size_t buffer_size)
+    {
+        std::unique_ptr<uring_writer> writer(new uring_writer(fd, buffer_size));
+        if (!writer->setup())
+            return nullptr;
+        return writer;
+    }
+
+    ~uring_writer()
+    {
+        wait_all();
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, sqes_size);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            ::munmap(cq_map, cq_map_size);
+        if (sq_map != MAP_FAILED)
+            ::munmap(sq_map, sq_map_size);
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+        for (char* b : buffers)
+            std::free(b);
+    }
+
+    uring_writer(const uring_writer&) = delete;
+    uring_writer& operator=(const uring_writer&) = delete;
+
+    /* The buffer to fill, buffer_size bytes */
+    char* buffer() const { return buffers[filling]; }
+
+    /* Whether every submitted buffer is written */
+    bool idle() const { return queued == 0; }
+
+    /**
+     * @brief Hands the filled buffer over to be written and moves on to the next one.
+     * @param used The bytes of the buffer to write.
+     * @details Waits only if every buffer is still waiting to be written.
+     */
+    void submit(size_t used)
+    {
+        lengths[filling] = used;
+        filling = (filling + 1) % buffer_count;
+        ++queued;
+        if (failed)
+        {
+            write_queued();
+            return;
+        }
+        pump();
+        while (queued == buffer_count)
+        {
+            reap(true);
+            pump();
+        }
+    }
+
+    /**
+     * @brief Starts the next write once the one in flight is done, without waiting.
+     */
+    void pump()
+    {
+        if (!reap(false) || !queued)
+            return;
+        if (failed)
+            write_queued();
+        else
+            start_write();
+    }
+
+    /**
+     * @brief Waits until every submitted buffer is written.
+     */
+    void wait_all()
+    {
+        while (queued)
+        {
+            reap(true);
+            pump();
+        }
+    }
+
+    /**
+     * @brief Writes the submitted buffers with write(2), for the crash handler.
+     * @details Async-signal-safe. Gives the write in flight up to 100 ms to complete, the kernel
+     *          finishes it on its own, then writes the buffers waiting after it, oldest first. The
+     *          caller writes the buffer being filled after that.
+     */
+    void drain_on_crash()
+    {
+        for (int i = 0; i < 100 && !reap(false); ++i)
+        {
+            timespec pause{0, 1000000};
+            ::nanosleep(&pause, nullptr);
+        }
+        if (in_flight)
+        {
+            in_flight = false;
+            --queued;
+        }
+        write_queued();
+    }
+};
+
+#else
+
+/* Without <linux/io_uring.h> there is no ring, the file writes fall back to writev(2) */
+class uring_writer
+{
+public:
+    static std::unique_ptr<uring_writer> create(int, size_t) { return nullptr; }
+    char* buffer() const { return nullptr; }
+    bool idle() const { return true; }
+    void submit(size_t) {}
+    void pump() {}
+    void wait_all() {}
+    void drain_on_crash() {}
+};
+
+#endif